@@ -13,7 +13,11 @@ get_cpu_usage() {
 }
 
 # Check if raw mode is requested
-if [ "$1" == "raw" ]; then
+if [ "$1" == "modules" ]; then
+    # Built-in sources: one line, limebar keeps the values current
+    echo "[F=$ICON_COLOR:  ] [F=$CPU_COLOR:CPU {cpu}] [A=r:{clock}]" |
+        ./result/bin/limebar -B "#1a1a1a" -f "FiraCode Nerd Font 11" -p 10
+elif [ "$1" == "raw" ]; then
     # Raw mode
     while true; do
         CPU=$(get_cpu_usage)
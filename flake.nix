@@ -50,21 +50,50 @@
               ${pkgs.wayland-protocols}/share/wayland-protocols/stable/xdg-shell/xdg-shell.xml \
               xdg-shell-client-protocol.c
 
+            # Generate viewporter and fractional scale protocols
+            wayland-scanner client-header \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/stable/viewporter/viewporter.xml \
+              viewporter-client-protocol.h
+            wayland-scanner private-code \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/stable/viewporter/viewporter.xml \
+              viewporter-client-protocol.c
+            wayland-scanner client-header \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/staging/fractional-scale/fractional-scale-v1.xml \
+              fractional-scale-v1-client-protocol.h
+            wayland-scanner private-code \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/staging/fractional-scale/fractional-scale-v1.xml \
+              fractional-scale-v1-client-protocol.c
+
             # Build the program
-            $CC -g -Wall -Wextra \
+            $CC -g -Wall -Wextra -pthread \
               $(pkg-config --cflags wayland-client cairo pango pangocairo) \
               -I. \
               -o limebar \
               limebar.c \
               wlr-layer-shell-unstable-v1-client-protocol.c \
               xdg-shell-client-protocol.c \
+              viewporter-client-protocol.c \
+              fractional-scale-v1-client-protocol.c \
+              $(pkg-config --libs wayland-client cairo pango pangocairo) \
+              -lwayland-client
+
+            # Build the benchmark binary, which also counts allocations
+            $CC -O2 -g -Wall -Wextra -pthread -DLIMEBAR_COUNT_ALLOCS \
+              $(pkg-config --cflags wayland-client cairo pango pangocairo) \
+              -I. \
+              -o limebar-bench \
+              limebar.c \
+              wlr-layer-shell-unstable-v1-client-protocol.c \
+              xdg-shell-client-protocol.c \
+              viewporter-client-protocol.c \
+              fractional-scale-v1-client-protocol.c \
               $(pkg-config --libs wayland-client cairo pango pangocairo) \
               -lwayland-client
           '';
 
           installPhase = ''
             mkdir -p $out/bin
-            cp limebar $out/bin/
+            cp limebar limebar-bench $out/bin/
           '';
         };
 
@@ -112,14 +141,43 @@
               ${pkgs.wayland-protocols}/share/wayland-protocols/stable/xdg-shell/xdg-shell.xml \
               xdg-shell-client-protocol.c
 
+            # Generate viewporter and fractional scale protocols
+            wayland-scanner client-header \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/stable/viewporter/viewporter.xml \
+              viewporter-client-protocol.h
+            wayland-scanner private-code \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/stable/viewporter/viewporter.xml \
+              viewporter-client-protocol.c
+            wayland-scanner client-header \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/staging/fractional-scale/fractional-scale-v1.xml \
+              fractional-scale-v1-client-protocol.h
+            wayland-scanner private-code \
+              ${pkgs.wayland-protocols}/share/wayland-protocols/staging/fractional-scale/fractional-scale-v1.xml \
+              fractional-scale-v1-client-protocol.c
+
             echo "Building limebar..."
-            cc -g -Wall -Wextra \
+            cc -g -Wall -Wextra -pthread \
               $(pkg-config --cflags wayland-client cairo pango pangocairo) \
               -I. \
               -o limebar \
               limebar.c \
               wlr-layer-shell-unstable-v1-client-protocol.c \
               xdg-shell-client-protocol.c \
+              viewporter-client-protocol.c \
+              fractional-scale-v1-client-protocol.c \
+              $(pkg-config --libs wayland-client cairo pango pangocairo) \
+              -lwayland-client
+
+            echo "Building limebar-bench..."
+            cc -O2 -g -Wall -Wextra -pthread -DLIMEBAR_COUNT_ALLOCS \
+              $(pkg-config --cflags wayland-client cairo pango pangocairo) \
+              -I. \
+              -o limebar-bench \
+              limebar.c \
+              wlr-layer-shell-unstable-v1-client-protocol.c \
+              xdg-shell-client-protocol.c \
+              viewporter-client-protocol.c \
+              fractional-scale-v1-client-protocol.c \
               $(pkg-config --libs wayland-client cairo pango pangocairo) \
               -lwayland-client
 
@@ -1,20 +1,43 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <cairo/cairo.h>
 #include <poll.h>
+#include <time.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <wayland-client.h>
 #include <wayland-client-protocol.h>
 #include "xdg-shell-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
 #include <pango/pango.h>
 #include <pango/pangocairo.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIMEBAR_X86_FILL
+#endif
 
 struct bar_config {
     int width;
@@ -24,6 +47,7 @@ struct bar_config {
     int num_fonts;
     int underline_thickness;
     bool raw_mode;        // Add this for raw text mode
+    bool json;            // Read the i3bar JSON protocol
         char *text_color;     // Add this for default text
 
     // New options
@@ -43,6 +67,17 @@ struct bar_config {
     int margin_right;
     char *separator;       // Block separator
     double opacity;        // Background opacity
+    int max_fps;           // Redraw rate cap, 0 for compositor pace only
+    int block_cache_kib;   // Rendered block cache budget
+    bool headless;         // Render without a compositor
+    char *dump_path;       // Where headless frames are written
+    bool rgb565;           // 16 bit buffers for opaque bars
+    bool render_thread;    // Lay out and rasterize on a worker thread
+    int stats_interval;    // Seconds between --stats dumps, 0 for none
+    char *control_path;    // Control socket, NULL for none
+    bool exit_on_eof;      // Quit instead of keeping the last frame
+    char **commands;       // --block ID:INTERVAL:COMMAND specs
+    int num_commands;
 };
 
 static void print_usage(const char *program_name) {
@@ -52,6 +87,7 @@ static void print_usage(const char *program_name) {
         "Options:\n"
         "  -r, --raw              Enable raw text mode (no block parsing)\n"
         "  -F, --text-color COLOR Set default text color for raw mode\n"
+        "      --json             Read the i3bar/swaybar JSON protocol\n"
         "  -g, --geometry WxH+X+Y    Set bar geometry (e.g., 1920x24+0+0)\n"
         "  -B, --background COLOR    Set background color (e.g., #1a1a1a)\n"
         "  -f, --font FONT          Add font (can be used multiple times)\n"
@@ -62,6 +98,20 @@ static void print_usage(const char *program_name) {
         "  -m, --margin MARGINS     Set margins (top,right,bottom,left)\n"
         "  -s, --separator STRING   Set block separator\n"
         "  -o, --opacity FLOAT      Set background opacity (0.0-1.0)\n"
+        "      --max-fps N          Cap redraws to N frames per second\n"
+        "      --block-cache KIB    Memory for rendered blocks (default: 2048, 0 disables)\n"
+        "      --headless           Render stdin without a Wayland compositor\n"
+        "      --dump PATH          Write headless frames to PATH (.png or raw pixels)\n"
+        "      --rgb565             Use 16 bit buffers when the background is opaque\n"
+        "      --render-thread      Lay out and draw frames on a separate thread\n"
+        "      --bench SCENARIO     Benchmark parse and draw (all|blocks|long|colors|rate|clock)\n"
+        "      --bench-frames N     Frames per benchmark scenario (default: 1000)\n"
+        "      --bench-parse N      Time N parses of a sample line and exit\n"
+        "      --bench-fill N       Time N frames of solid fills on 4K and 8K bars and exit\n"
+        "      --stats SECONDS      Print frame and cache statistics every SECONDS\n"
+        "      --control PATH       Listen for commands on a Unix socket at PATH\n"
+        "      --on-eof POLICY      When stdin closes: keep the last frame or exit (keep|exit)\n"
+        "      --block ID:SECS:CMD  Run CMD every SECS seconds (0 keeps it running) into block ID\n"
         "  -h, --help              Show this help message\n",
         program_name);
 }
@@ -70,461 +120,5285 @@ static void parse_geometry(const char *geometry, int *width, int *height, int *x
     sscanf(geometry, "%dx%d+%d+%d", width, height, x, y);
 }
 
-static void parse_color_str(const char *color, double *r, double *g, double *b, double *a) {
-    if (color[0] == '#') {
-        unsigned int rgb;
-        if (strlen(color) == 7) { // #RRGGBB
-            sscanf(color + 1, "%x", &rgb);
-            *r = ((rgb >> 16) & 0xFF) / 255.0;
-            *g = ((rgb >> 8) & 0xFF) / 255.0;
-            *b = (rgb & 0xFF) / 255.0;
-            *a = 1.0;
-        } else if (strlen(color) == 9) { // #RRGGBBAA
-            sscanf(color + 1, "%x", &rgb);
-            *r = ((rgb >> 24) & 0xFF) / 255.0;
-            *g = ((rgb >> 16) & 0xFF) / 255.0;
-            *b = ((rgb >> 8) & 0xFF) / 255.0;
-            *a = (rgb & 0xFF) / 255.0;
+/* Colors are stored packed and premultiplied in the ARGB32 pixel layout
+ * shared by cairo and wl_shm: 0xAARRGGBB. */
+#define COLOR_WHITE 0xffffffffu
+
+static uint32_t pack_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    r = (r * a + 127) / 255;
+    g = (g * a + 127) / 255;
+    b = (b * a + 127) / 255;
+    return (uint32_t)a << 24 | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Parse #RRGGBB or #RRGGBBAA into a packed color. */
+static bool parse_color(const char *color, size_t len, uint32_t *out) {
+    if ((len != 7 && len != 9) || color[0] != '#')
+        return false;
+
+    uint8_t channels[4] = {0, 0, 0, 0xff};
+    for (size_t i = 0; i < (len - 1) / 2; i++) {
+        int hi = hex_digit(color[1 + i * 2]);
+        int lo = hex_digit(color[2 + i * 2]);
+        if (hi < 0 || lo < 0)
+            return false;
+        channels[i] = hi << 4 | lo;
+    }
+
+    *out = pack_color(channels[0], channels[1], channels[2], channels[3]);
+    return true;
+}
+
+static void set_source_color(cairo_t *cr, uint32_t color) {
+    double a = (color >> 24) / 255.0;
+    if (a == 0.0) {
+        cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.0);
+        return;
+    }
+    // cairo takes straight alpha
+    cairo_set_source_rgba(cr,
+        ((color >> 16) & 0xff) / 255.0 / a,
+        ((color >> 8) & 0xff) / 255.0 / a,
+        (color & 0xff) / 255.0 / a,
+        a);
+}
+
+/* Solid fills of axis-aligned rectangles, written straight into image
+ * memory instead of going through cairo's rasterizer. Row kernels store a
+ * repeated 32 bit pattern; SSE2 and AVX2 versions are picked at startup on
+ * x86, everything else uses the scalar loop. */
+typedef void (*fill_row_fn)(uint32_t *dst, size_t count, uint32_t pattern);
+
+static void fill_row_scalar(uint32_t *dst, size_t count, uint32_t pattern) {
+    for (size_t i = 0; i < count; i++)
+        dst[i] = pattern;
+}
+
+#ifdef LIMEBAR_X86_FILL
+__attribute__((target("sse2")))
+static void fill_row_sse2(uint32_t *dst, size_t count, uint32_t pattern) {
+    for (; count > 0 && ((uintptr_t)dst & 15); count--)
+        *dst++ = pattern;
+
+    __m128i v = _mm_set1_epi32(pattern);
+    for (; count >= 8; count -= 8, dst += 8) {
+        _mm_store_si128((__m128i *)dst, v);
+        _mm_store_si128((__m128i *)dst + 1, v);
+    }
+    for (; count >= 4; count -= 4, dst += 4)
+        _mm_store_si128((__m128i *)dst, v);
+    while (count--)
+        *dst++ = pattern;
+}
+
+__attribute__((target("avx2")))
+static void fill_row_avx2(uint32_t *dst, size_t count, uint32_t pattern) {
+    for (; count > 0 && ((uintptr_t)dst & 31); count--)
+        *dst++ = pattern;
+
+    __m256i v = _mm256_set1_epi32(pattern);
+    for (; count >= 16; count -= 16, dst += 16) {
+        _mm256_store_si256((__m256i *)dst, v);
+        _mm256_store_si256((__m256i *)dst + 1, v);
+    }
+    for (; count >= 8; count -= 8, dst += 8)
+        _mm256_store_si256((__m256i *)dst, v);
+    while (count--)
+        *dst++ = pattern;
+}
+#endif
+
+static fill_row_fn fill_row = fill_row_scalar;
+
+static void fill_init(void) {
+#ifdef LIMEBAR_X86_FILL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fill_row = fill_row_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        fill_row = fill_row_sse2;
+#endif
+}
+
+/* Fill a rectangle of a buffer in format with a premultiplied color. The
+ * rectangle must lie inside the buffer. */
+static void fill_rect(unsigned char *data, int stride, cairo_format_t format,
+        int x, int y, int width, int height, uint32_t color) {
+    if (width <= 0 || height <= 0)
+        return;
+
+    if (format != CAIRO_FORMAT_RGB16_565) {
+        unsigned char *row = data + (size_t)y * stride + (size_t)x * 4;
+        for (int i = 0; i < height; i++, row += stride)
+            fill_row((uint32_t *)row, width, color);
+        return;
+    }
+
+    // Two 565 pixels per 32 bit store, with odd edges written singly;
+    // the conversion truncates like pixman's
+    uint16_t pixel = (color >> 8 & 0xf800) | (color >> 5 & 0x07e0) | (color >> 3 & 0x001f);
+    unsigned char *row = data + (size_t)y * stride + (size_t)x * 2;
+    for (int i = 0; i < height; i++, row += stride) {
+        uint16_t *dst = (uint16_t *)row;
+        size_t count = width;
+        if ((uintptr_t)dst & 2) {
+            *dst++ = pixel;
+            count--;
+        }
+        fill_row((uint32_t *)dst, count / 2, (uint32_t)pixel << 16 | pixel);
+        if (count & 1)
+            dst[count - 1] = pixel;
+    }
+}
+
+/* Fill a rectangle the way cairo_rectangle() and cairo_fill() would, but
+ * directly, when that gives the same pixels: cr targets an image, maps the
+ * rectangle onto whole pixels and either replaces what is there or puts an
+ * opaque color over it. Returns false, drawing nothing, otherwise. Like
+ * the atlas blit, it ignores cr's clip. */
+static bool fill_solid(cairo_t *cr, double x, double y, double width, double height,
+        uint32_t color) {
+    cairo_operator_t op = cairo_get_operator(cr);
+    if (op != CAIRO_OPERATOR_SOURCE && !(op == CAIRO_OPERATOR_OVER && color >> 24 == 0xff))
+        return false;
+
+    cairo_surface_t *target = cairo_get_target(cr);
+    if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE)
+        return false;
+    cairo_matrix_t matrix;
+    cairo_get_matrix(cr, &matrix);
+    if (matrix.xy != 0 || matrix.yx != 0 || matrix.xx <= 0 || matrix.yy <= 0)
+        return false;
+
+    double x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+    cairo_user_to_device(cr, &x0, &y0);
+    cairo_user_to_device(cr, &x1, &y1);
+    if (x0 != (int)x0 || y0 != (int)y0 || x1 != (int)x1 || y1 != (int)y1)
+        return false;
+
+    // Clamp to the surface like cairo would
+    int surface_width = cairo_image_surface_get_width(target);
+    int surface_height = cairo_image_surface_get_height(target);
+    int ix0 = x0 < 0 ? 0 : x0, iy0 = y0 < 0 ? 0 : y0;
+    int ix1 = x1 > surface_width ? surface_width : x1;
+    int iy1 = y1 > surface_height ? surface_height : y1;
+    if (ix1 <= ix0 || iy1 <= iy0)
+        return true;
+
+    cairo_surface_flush(target);
+    fill_rect(cairo_image_surface_get_data(target), cairo_image_surface_get_stride(target),
+            cairo_image_surface_get_format(target), ix0, iy0, ix1 - ix0, iy1 - iy0, color);
+    cairo_surface_mark_dirty_rectangle(target, ix0, iy0, ix1 - ix0, iy1 - iy0);
+    return true;
+}
+
+static uint32_t hash_bytes(const void *data, size_t len, uint32_t hash) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+/* Block colors repeat from one update to the next, so resolved strings are
+ * remembered in a small table instead of being parsed again. A string may
+ * live in any of COLOR_CACHE_WAYS slots starting at its hash. */
+#define COLOR_CACHE_SIZE 64
+#define COLOR_CACHE_WAYS 4
+#define COLOR_KEY_MAX 16
+
+struct color_cache_entry {
+    char key[COLOR_KEY_MAX];
+    uint32_t color;
+};
+
+struct color_cache {
+    struct color_cache_entry entries[COLOR_CACHE_SIZE];
+    unsigned long hits;
+    unsigned long misses;
+    unsigned int victim;    // Round-robin eviction within a full window
+};
+
+/* Resolve a block color string, falling back to white for anything that
+ * isn't a valid color as the old renderer did. */
+static uint32_t resolve_color(struct color_cache *cache, const char *color) {
+    size_t len = strlen(color);
+    if (len >= COLOR_KEY_MAX) {
+        uint32_t packed;
+        return parse_color(color, len, &packed) ? packed : COLOR_WHITE;
+    }
+
+    uint32_t hash = hash_bytes(color, len, 2166136261u);
+
+    struct color_cache_entry *entry = NULL;
+    for (unsigned int i = 0; i < COLOR_CACHE_WAYS; i++) {
+        struct color_cache_entry *slot =
+            &cache->entries[(hash + i) % COLOR_CACHE_SIZE];
+        if (!slot->key[0]) {
+            if (!entry)
+                entry = slot;
+            continue;
+        }
+        if (strcmp(slot->key, color) == 0) {
+            cache->hits++;
+            return slot->color;
+        }
+    }
+    if (!entry)
+        entry = &cache->entries[(hash + cache->victim++ % COLOR_CACHE_WAYS) % COLOR_CACHE_SIZE];
+
+    cache->misses++;
+    if (!parse_color(color, len, &entry->color))
+        entry->color = COLOR_WHITE;
+    memcpy(entry->key, color, len + 1);
+    return entry->color;
+}
+
+/* Shaped text keyed by (text, font index, scale). Most blocks are static, so
+ * shaping cost scales with what changed instead of with the block count.
+ * Entries in use by the current frame are never evicted; the table grows
+ * instead when a single frame needs more than LAYOUT_CACHE_SIZE layouts. */
+#define LAYOUT_CACHE_SIZE 64
+
+struct layout_cache_entry {
+    char *text;
+    size_t len;
+    int font_index;
+    int scale;
+    uint32_t hash;
+    PangoLayout *layout;
+    int width;
+    int height;
+    unsigned long last_used;    // Frame that last looked this entry up
+};
+
+struct layout_cache {
+    struct layout_cache_entry *entries;
+    size_t count;
+    size_t cap;
+    unsigned long frame;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* Return the shaped layout for text in the given font, out of fonts sized
+ * for scale, along with its pixel size. The layout stays valid until the
+ * next frame is started. */
+static PangoLayout *layout_cache_get(struct layout_cache *cache,
+        PangoContext *context, PangoFontDescription **fonts, int font_index,
+        int scale, const char *text, int *width, int *height) {
+    size_t len = strlen(text);
+    uint32_t hash = hash_bytes(text, len, (2166136261u ^ font_index) + scale);
+
+    for (size_t i = 0; i < cache->count; i++) {
+        struct layout_cache_entry *entry = &cache->entries[i];
+        if (entry->hash == hash && entry->font_index == font_index &&
+                entry->scale == scale && entry->len == len &&
+                memcmp(entry->text, text, len) == 0) {
+            entry->last_used = cache->frame;
+            *width = entry->width;
+            *height = entry->height;
+            cache->hits++;
+            return entry->layout;
+        }
+    }
+    cache->misses++;
+
+    // Reuse the least recently used entry not needed by this frame
+    struct layout_cache_entry *entry = NULL;
+    if (cache->count == cache->cap) {
+        for (size_t i = 0; i < cache->count; i++) {
+            struct layout_cache_entry *candidate = &cache->entries[i];
+            if (candidate->last_used == cache->frame)
+                continue;
+            if (!entry || candidate->last_used < entry->last_used)
+                entry = candidate;
+        }
+    }
+
+    if (entry) {
+        free(entry->text);
+    } else {
+        if (cache->count == cache->cap) {
+            size_t cap = cache->cap ? cache->cap * 2 : LAYOUT_CACHE_SIZE;
+            struct layout_cache_entry *entries = realloc(cache->entries, cap * sizeof(*entries));
+            if (!entries) {
+                fprintf(stderr, "Failed to grow layout cache: %s\n", strerror(errno));
+                exit(1);
+            }
+            cache->entries = entries;
+            cache->cap = cap;
+        }
+        entry = &cache->entries[cache->count++];
+        entry->layout = pango_layout_new(context);
+    }
+
+    entry->text = strndup(text, len);
+    entry->len = len;
+    entry->font_index = font_index;
+    entry->scale = scale;
+    entry->hash = hash;
+    entry->last_used = cache->frame;
+
+    pango_layout_set_font_description(entry->layout, fonts[font_index]);
+    pango_layout_set_text(entry->layout, text, len);
+    pango_layout_get_pixel_size(entry->layout, &entry->width, &entry->height);
+
+    *width = entry->width;
+    *height = entry->height;
+    return entry->layout;
+}
+
+static void layout_cache_finish(struct layout_cache *cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        free(cache->entries[i].text);
+        g_object_unref(cache->entries[i].layout);
+    }
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* The widest N= block, in glyph cells. */
+#define MAX_ATLAS_CELLS 64
+
+/* A parsed block. The text is a slice of the input line owned by the arena
+ * the block was parsed into and lives until the next update. Colors are
+ * resolved while parsing; a transparent bg_color means no background. */
+struct text_block {
+    char *text;
+    char *id;               // From I=, NULL for anonymous blocks
+    uint32_t fg_color;
+    uint32_t bg_color;
+    uint32_t underline_color;
+    int font_index;
+    bool underline;
+    int marquee;            // M= width in pixels, 0 for a normal block
+    bool subsurface;        // S, drawn on a subsurface of its own
+    int digits;             // N= width in glyph cells, 0 for shaped text
+    enum {
+        ALIGN_INHERIT,      // Follow the default alignment
+        ALIGN_LEFT,
+        ALIGN_CENTER,
+        ALIGN_RIGHT
+    } alignment;
+};
+
+/* Number of wl_buffers carved out of the shm pool; the compositor may hold
+ * one for scanout while we paint into another. */
+#define NUM_BUFFERS 3
+
+/* Debug tracing for the hot path. Compiled out unless built with
+ * -DLIMEBAR_TRACE=LEVEL: 1 traces frames, 2 adds parsed blocks and damage. */
+#ifndef LIMEBAR_TRACE
+#define LIMEBAR_TRACE 0
+#endif
+
+#define TRACE_FRAME 1
+#define TRACE_DETAIL 2
+
+#define TRACE(level, ...) do { \
+        if (LIMEBAR_TRACE >= (level)) \
+            fprintf(stderr, "limebar: " __VA_ARGS__); \
+    } while (0)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Per-stage timers and counters, reported by --stats and the control
+ * socket's "stats" command. */
+enum stat_stage {
+    STAGE_READ,
+    STAGE_PARSE,
+    STAGE_LAYOUT,
+    STAGE_RASTER,
+    STAGE_COMMIT,
+    NUM_STAGES
+};
+
+static const char *const stage_names[NUM_STAGES] = {
+    "read", "parse", "layout", "raster", "commit",
+};
+
+struct stats {
+    uint64_t stage_ns[NUM_STAGES];
+    uint64_t stage_max_ns[NUM_STAGES];
+    unsigned long stage_count[NUM_STAGES];
+    unsigned long lines_read;
+    unsigned long frames_drawn;
+    unsigned long frames_coalesced;     // Updates replaced before reaching the screen
+    unsigned long frames_unchanged;     // Draws with nothing new to show
+    unsigned long frames_shared;        // Copied from another output's buffer
+    uint64_t bytes_damaged;
+};
+
+static void stats_record(struct stats *stats, enum stat_stage stage, uint64_t elapsed) {
+    stats->stage_ns[stage] += elapsed;
+    stats->stage_count[stage]++;
+    if (elapsed > stats->stage_max_ns[stage])
+        stats->stage_max_ns[stage] = elapsed;
+}
+
+static void stats_stage(struct stats *stats, enum stat_stage stage, uint64_t start) {
+    stats_record(stats, stage, now_ns() - start);
+}
+
+/* Built-in data sources, referenced as {name} inside block text. Each one
+ * keeps its source file open, re-reads it with pread() on its own timerfd
+ * and only runs while the current line references it. */
+#define MODULE_TEXT_MAX 32
+
+enum {
+    MODULE_CPU,
+    MODULE_MEM,
+    MODULE_LOAD,
+    MODULE_CLOCK,
+    MODULE_BATTERY,
+    MODULE_NET,
+    NUM_MODULES
+};
+
+struct module {
+    const char *name;
+    int interval;               // Seconds between updates
+    bool wall_clock;            // Tick on whole seconds of the real time clock
+    void (*update)(struct module *module);
+    int fd;                     // Source file, -1 until first read
+    int timer_fd;               // -1 until the module is first referenced
+    bool armed;
+    bool ready;                 // text holds a value
+    char text[MODULE_TEXT_MAX];
+    uint64_t prev[2];           // Counters from the previous update
+    uint64_t prev_ns;
+    char *buf;                  // For files of no fixed size
+    size_t buf_size;
+};
+
+/* Read the whole of a small kernel file into buf, NUL-terminated. The file
+ * is opened on first use and kept open. */
+static ssize_t module_read(struct module *module, const char *path, char *buf, size_t size) {
+    if (module->fd < 0) {
+        module->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (module->fd < 0)
+            return -1;
+    }
+
+    ssize_t len = pread(module->fd, buf, size - 1, 0);
+    if (len < 0)
+        return -1;
+    buf[len] = '\0';
+    return len;
+}
+
+/* Like module_read(), for files that grow with the machine, such as
+ * /proc/net/dev with one line per interface. The file is read to its end
+ * into the module's buffer, which grows to fit. */
+static char *module_read_all(struct module *module, const char *path) {
+    if (module->fd < 0) {
+        module->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (module->fd < 0)
+            return NULL;
+    }
+
+    size_t len = 0;
+    for (;;) {
+        if (module->buf_size - len < 4096) {
+            size_t size = module->buf_size ? module->buf_size * 2 : 4096;
+            char *buf = realloc(module->buf, size);
+            if (!buf) {
+                fprintf(stderr, "Failed to grow module buffer: %s\n", strerror(errno));
+                exit(1);
+            }
+            module->buf = buf;
+            module->buf_size = size;
+        }
+        ssize_t bytes_read = pread(module->fd, module->buf + len,
+                module->buf_size - len - 1, len);
+        if (bytes_read < 0)
+            return NULL;
+        if (bytes_read == 0)
+            break;
+        len += bytes_read;
+    }
+    module->buf[len] = '\0';
+    return module->buf;
+}
+
+static void module_cpu(struct module *module) {
+    char buf[256];
+    if (module_read(module, "/proc/stat", buf, sizeof(buf)) < 0)
+        return;
+
+    // cpu user nice system idle iowait irq softirq steal
+    uint64_t total = 0, idle = 0;
+    char *p = buf + 3;
+    for (int i = 0; i < 8; i++) {
+        uint64_t value = strtoull(p, &p, 10);
+        total += value;
+        if (i == 3 || i == 4)
+            idle += value;
+    }
+
+    // The first sample covers everything since boot
+    uint64_t total_delta = total - module->prev[0];
+    uint64_t idle_delta = idle - module->prev[1];
+    module->prev[0] = total;
+    module->prev[1] = idle;
+    int usage = total_delta ? (total_delta - idle_delta) * 100 / total_delta : 0;
+    snprintf(module->text, sizeof(module->text), "%d%%", usage);
+}
+
+static uint64_t meminfo_field(const char *buf, const char *field) {
+    const char *p = strstr(buf, field);
+    return p ? strtoull(p + strlen(field), NULL, 10) : 0;
+}
+
+static void module_mem(struct module *module) {
+    char buf[2048];
+    if (module_read(module, "/proc/meminfo", buf, sizeof(buf)) < 0)
+        return;
+
+    uint64_t total = meminfo_field(buf, "MemTotal:");
+    uint64_t available = meminfo_field(buf, "MemAvailable:");
+    int used = total ? (total - available) * 100 / total : 0;
+    snprintf(module->text, sizeof(module->text), "%d%%", used);
+}
+
+static void module_load(struct module *module) {
+    char buf[128];
+    if (module_read(module, "/proc/loadavg", buf, sizeof(buf)) < 0)
+        return;
+
+    // One minute average
+    size_t len = strcspn(buf, " ");
+    if (len >= sizeof(module->text))
+        len = sizeof(module->text) - 1;
+    memcpy(module->text, buf, len);
+    module->text[len] = '\0';
+}
+
+static void module_clock(struct module *module) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(module->text, sizeof(module->text), "%H:%M", &tm);
+}
+
+static void module_battery(struct module *module) {
+    char path[300] = "";
+
+    // Use the first battery the kernel exposes
+    if (module->fd < 0) {
+        DIR *dir = opendir("/sys/class/power_supply");
+        if (!dir)
+            return;
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (strncmp(entry->d_name, "BAT", 3) == 0) {
+                snprintf(path, sizeof(path), "/sys/class/power_supply/%s/capacity",
+                        entry->d_name);
+                break;
+            }
+        }
+        closedir(dir);
+        if (!path[0])
+            return;
+    }
+
+    char buf[16];
+    if (module_read(module, path, buf, sizeof(buf)) < 0)
+        return;
+    snprintf(module->text, sizeof(module->text), "%d%%", atoi(buf));
+}
+
+static void format_rate(char *out, size_t size, double rate) {
+    static const char units[] = "BKMG";
+    int unit = 0;
+    while (rate >= 1000.0 && unit < 3) {
+        rate /= 1024.0;
+        unit++;
+    }
+    snprintf(out, size, rate < 10.0 && unit ? "%.1f%c" : "%.0f%c", rate, units[unit]);
+}
+
+static void module_net(struct module *module) {
+    char *buf = module_read_all(module, "/proc/net/dev");
+    if (!buf)
+        return;
+
+    // Two header lines, then "iface: rx_bytes 7 more rx fields tx_bytes ..."
+    uint64_t rx = 0, tx = 0;
+    char *line = strchr(buf, '\n');
+    line = line ? strchr(line + 1, '\n') : NULL;
+    while (line && *++line) {
+        char *colon = strchr(line, ':');
+        if (!colon)
+            break;
+        while (*line == ' ')
+            line++;
+
+        char *p = colon + 1;
+        uint64_t fields[9];
+        for (int i = 0; i < 9; i++)
+            fields[i] = strtoull(p, &p, 10);
+        if (strncmp(line, "lo:", 3) != 0) {
+            rx += fields[0];
+            tx += fields[8];
+        }
+        line = strchr(p, '\n');
+    }
+
+    uint64_t now = now_ns();
+    double seconds = (now - module->prev_ns) / 1e9;
+    char down[16] = "0B", up[16] = "0B";
+    if (module->prev_ns) {
+        // The sums go down when an interface goes away or a counter resets
+        uint64_t rx_delta = rx > module->prev[0] ? rx - module->prev[0] : 0;
+        uint64_t tx_delta = tx > module->prev[1] ? tx - module->prev[1] : 0;
+        format_rate(down, sizeof(down), rx_delta / seconds);
+        format_rate(up, sizeof(up), tx_delta / seconds);
+    }
+    module->prev[0] = rx;
+    module->prev[1] = tx;
+    module->prev_ns = now;
+    snprintf(module->text, sizeof(module->text), "down %s up %s", down, up);
+}
+
+static const struct module module_table[NUM_MODULES] = {
+    [MODULE_CPU] = {.name = "cpu", .interval = 1, .update = module_cpu},
+    [MODULE_MEM] = {.name = "mem", .interval = 2, .update = module_mem},
+    [MODULE_LOAD] = {.name = "load", .interval = 5, .update = module_load},
+    [MODULE_CLOCK] = {.name = "clock", .interval = 1, .wall_clock = true, .update = module_clock},
+    [MODULE_BATTERY] = {.name = "battery", .interval = 30, .update = module_battery},
+    [MODULE_NET] = {.name = "net", .interval = 1, .update = module_net},
+};
+
+static void modules_init(struct module *modules) {
+    for (int i = 0; i < NUM_MODULES; i++) {
+        modules[i] = module_table[i];
+        modules[i].fd = -1;
+        modules[i].timer_fd = -1;
+    }
+}
+
+/* Copy text to out with every {name} replaced by that module's value, and
+ * flag the modules used in refs. Unknown names are left as they are. out
+ * must have room for MODULE_TEXT_MAX bytes per '{' on top of the text. */
+static char *expand_modules(const char *text, char *out, struct module *modules,
+        uint32_t *refs) {
+    while (*text) {
+        const char *close = text[0] == '{' ? strchr(text, '}') : NULL;
+        int found = -1;
+        if (close) {
+            for (int i = 0; i < NUM_MODULES; i++) {
+                size_t len = strlen(modules[i].name);
+                if ((size_t)(close - text - 1) == len &&
+                        memcmp(text + 1, modules[i].name, len) == 0) {
+                    found = i;
+                    break;
+                }
+            }
+        }
+
+        if (found < 0) {
+            *out++ = *text++;
+            continue;
+        }
+
+        struct module *module = &modules[found];
+        if (!module->ready) {
+            module->update(module);
+            module->ready = true;
+        }
+        size_t len = strlen(module->text);
+        memcpy(out, module->text, len);
+        out += len;
+        *refs |= 1u << found;
+        text = close + 1;
+    }
+    *out++ = '\0';
+    return out;
+}
+
+/* Bump allocator holding one update's worth of parsed blocks and the input
+ * line their strings point into. Resetting is O(1) and the backing store only
+ * ever grows, so once it has seen the longest line no update allocates. */
+struct arena {
+    char *data;
+    size_t used;
+    size_t cap;
+    unsigned long grows;    // Times the backing store was (re)allocated
+};
+
+#define ARENA_ALIGN(size) (((size) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+/* Drop everything in the arena and make sure at least size bytes fit before
+ * anything is handed out, so pointers stay valid until the next reset. */
+static void arena_reset(struct arena *arena, size_t size) {
+    arena->used = 0;
+    if (size <= arena->cap)
+        return;
+
+    size_t cap = arena->cap ? arena->cap : 4096;
+    while (cap < size)
+        cap *= 2;
+
+    char *data = realloc(arena->data, cap);
+    if (!data) {
+        fprintf(stderr, "Failed to grow block arena: %s\n", strerror(errno));
+        exit(1);
+    }
+    arena->data = data;
+    arena->cap = cap;
+    arena->grows++;
+}
+
+static void *arena_alloc(struct arena *arena, size_t size) {
+    size = ARENA_ALIGN(size);
+    if (arena->cap - arena->used < size)
+        return NULL;
+
+    void *ptr = arena->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+static char *attr_value(char *attr) {
+    return attr[1] == '=' ? attr + 2 : attr + 1;
+}
+
+/* Parse "[attrs:text]..." into a contiguous array of blocks allocated from
+ * the arena. The line is copied into the arena once and every string in a
+ * block is a NUL-terminated slice of that copy. Text runs from the first ':'
+ * to the closing ']', so it may itself contain ':'. With modules, {name} in
+ * the text is replaced by the module's value and flagged in module_refs. */
+static struct text_block *parse_input(const char *input, size_t len,
+        struct arena *arena, struct color_cache *colors,
+        struct module *modules, uint32_t *module_refs, size_t *num_blocks) {
+    // Every block opens with '[', which bounds how many there can be
+    size_t max_blocks = 0;
+    for (const char *p = input; (p = memchr(p, '[', input + len - p)); p++)
+        max_blocks++;
+
+    // Likewise every module reference opens with '{'
+    size_t expand_size = 0;
+    if (modules) {
+        for (const char *p = input; (p = memchr(p, '{', input + len - p)); p++)
+            expand_size += MODULE_TEXT_MAX;
+        if (expand_size)
+            expand_size += len + 1;
+    }
+
+    arena_reset(arena, ARENA_ALIGN(max_blocks * sizeof(struct text_block))
+            + ARENA_ALIGN(len + 1) + ARENA_ALIGN(expand_size));
+    struct text_block *blocks = arena_alloc(arena, max_blocks * sizeof(struct text_block));
+    char *str = arena_alloc(arena, len + 1);
+    char *expanded = expand_size ? arena_alloc(arena, expand_size) : NULL;
+    memcpy(str, input, len);
+    str[len] = '\0';
+
+    size_t count = 0;
+    char *end = str + len;
+    char *p = str;
+    while ((p = memchr(p, '[', end - p))) {
+        char *attrs = p + 1;
+        char *close = memchr(attrs, ']', end - attrs);
+        if (!close)
+            break;
+        *close = '\0';
+        p = close + 1;
+
+        char *colon = strchr(attrs, ':');
+        if (!colon)
+            continue;
+        *colon = '\0';
+
+        struct text_block *block = &blocks[count++];
+        memset(block, 0, sizeof(*block));
+        block->text = colon + 1;
+        block->fg_color = COLOR_WHITE;
+        bool has_underline_color = false;
+
+        // Skip leading whitespace
+        while (*attrs == ' ') attrs++;
+
+        char *attr = attrs;
+        while (attr) {
+            char *comma = strchr(attr, ',');
+            if (comma)
+                *comma = '\0';
+
+            switch (attr[0]) {
+                case 'F':
+                    block->fg_color = resolve_color(colors, attr_value(attr));
+                    break;
+                case 'B':
+                    block->bg_color = resolve_color(colors, attr_value(attr));
+                    break;
+                case 'U':
+                    block->underline_color = resolve_color(colors, attr_value(attr));
+                    has_underline_color = true;
+                    break;
+                case 'T':
+                    block->font_index = atoi(attr_value(attr)) - 1;
+                    if (block->font_index < 0) block->font_index = 0;
+                    break;
+                case 'u':
+                    block->underline = true;
+                    break;
+                case 'I':
+                    block->id = attr_value(attr);
+                    break;
+                case 'M':
+                    block->marquee = atoi(attr_value(attr));
+                    if (block->marquee < 0) block->marquee = 0;
+                    break;
+                case 'S':
+                    block->subsurface = true;
+                    break;
+                case 'N':
+                    block->digits = atoi(attr_value(attr));
+                    if (block->digits < 0) block->digits = 0;
+                    if (block->digits > MAX_ATLAS_CELLS) block->digits = MAX_ATLAS_CELLS;
+                    break;
+                case 'A':
+                    switch (attr_value(attr)[0]) {
+                        case 'l': block->alignment = ALIGN_LEFT; break;
+                        case 'c': block->alignment = ALIGN_CENTER; break;
+                        case 'r': block->alignment = ALIGN_RIGHT; break;
+                    }
+                    break;
+            }
+            attr = comma ? comma + 1 : NULL;
+        }
+
+        // Underlines default to the text color
+        if (!has_underline_color)
+            block->underline_color = block->fg_color;
+
+        if (expanded && strchr(block->text, '{')) {
+            char *text = expanded;
+            expanded = expand_modules(block->text, expanded, modules, module_refs);
+            block->text = text;
+        }
+    }
+
+    *num_blocks = count;
+    return blocks;
+}
+
+/* Raw mode: the whole line is a single block in the default text color. */
+static struct text_block *parse_raw_input(const char *input, size_t len,
+        uint32_t text_color, struct arena *arena, size_t *num_blocks) {
+    arena_reset(arena, ARENA_ALIGN(sizeof(struct text_block)) + ARENA_ALIGN(len + 1));
+    struct text_block *block = arena_alloc(arena, sizeof(struct text_block));
+    char *str = arena_alloc(arena, len + 1);
+    memcpy(str, input, len);
+    str[len] = '\0';
+
+    memset(block, 0, sizeof(*block));
+    block->text = str;
+    block->fg_color = text_color;
+    block->underline_color = text_color;
+    block->font_index = 0;
+
+    *num_blocks = 1;
+    return block;
+}
+
+/* Minimal JSON for the i3bar protocol. Strings are unescaped in place and
+ * NUL-terminated, so parsing a status never allocates. Each function takes
+ * the position of a value and returns the position after it, or NULL if
+ * the input is malformed. */
+static char *json_skip_ws(char *p, char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
+
+static char *json_skip_string(char *p, char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\')
+            p++;
+        else if (*p == '"')
+            return p + 1;
+    }
+    return NULL;
+}
+
+static char *json_skip_value(char *p, char *end) {
+    if (p >= end)
+        return NULL;
+    if (*p == '"')
+        return json_skip_string(p, end);
+    if (*p != '{' && *p != '[') {
+        while (p < end && *p != ',' && *p != '}' && *p != ']')
+            p++;
+        return p;
+    }
+
+    int depth = 0;
+    while (p < end) {
+        if (*p == '"') {
+            p = json_skip_string(p, end);
+            if (!p)
+                return NULL;
+            continue;
+        }
+        if (*p == '{' || *p == '[')
+            depth++;
+        else if ((*p == '}' || *p == ']') && --depth == 0)
+            return p + 1;
+        p++;
+    }
+    return NULL;
+}
+
+static int json_hex(const char *p) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_digit(p[i]);
+        if (digit < 0)
+            return -1;
+        value = value << 4 | digit;
+    }
+    return value;
+}
+
+/* Unescape the string at p in place; *out gets the NUL-terminated result. */
+static char *json_string(char *p, char *end, char **out) {
+    if (p >= end || *p != '"')
+        return NULL;
+
+    char *r = p + 1, *w = p + 1;
+    *out = w;
+    while (r < end && *r != '"') {
+        if (*r != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+        if (++r >= end)
+            return NULL;
+        switch (*r++) {
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u': {
+                int c = end - r >= 4 ? json_hex(r) : -1;
+                if (c < 0)
+                    return NULL;
+                r += 4;
+                // Join surrogate pairs
+                if (c >= 0xd800 && c < 0xdc00 && end - r >= 6 && r[0] == '\\' && r[1] == 'u') {
+                    int low = json_hex(r + 2);
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                        r += 6;
+                    }
+                }
+                // Six escaped bytes always have room for four encoded ones
+                if (c < 0x80) {
+                    *w++ = c;
+                } else if (c < 0x800) {
+                    *w++ = 0xc0 | c >> 6;
+                    *w++ = 0x80 | (c & 0x3f);
+                } else if (c < 0x10000) {
+                    *w++ = 0xe0 | c >> 12;
+                    *w++ = 0x80 | (c >> 6 & 0x3f);
+                    *w++ = 0x80 | (c & 0x3f);
+                } else {
+                    *w++ = 0xf0 | c >> 18;
+                    *w++ = 0x80 | (c >> 12 & 0x3f);
+                    *w++ = 0x80 | (c >> 6 & 0x3f);
+                    *w++ = 0x80 | (c & 0x3f);
+                }
+                break;
+            }
+            default: *w++ = r[-1]; break;   // \" \\ \/
+        }
+    }
+    if (r >= end)
+        return NULL;
+    *w = '\0';
+    return r + 1;
+}
+
+/* The "name" and "instance" values of a block object, still escaped. */
+struct json_block_id {
+    const char *name;
+    size_t name_len;
+    const char *instance;
+    size_t instance_len;
+};
+
+/* Find the "name" and "instance" of the block object at p without
+ * unescaping anything, and hash them. Returns 0 for blocks without a name. */
+static uint32_t json_block_key(char *p, char *end, struct json_block_id *id) {
+    uint32_t key = 0;
+    *id = (struct json_block_id){.name = "", .instance = ""};
+    p = json_skip_ws(p + 1, end);
+    while (p && p < end && *p == '"') {
+        char *key_end = json_skip_string(p, end);
+        if (!key_end)
+            return 0;
+        size_t key_len = key_end - p;
+        char *value = json_skip_ws(key_end, end);
+        if (value >= end || *value != ':')
+            return 0;
+        value = json_skip_ws(value + 1, end);
+        char *value_end = json_skip_value(value, end);
+        if (!value_end)
+            return 0;
+
+        bool is_name = key_len == 6 && memcmp(p, "\"name\"", 6) == 0;
+        if (is_name || (key_len == 10 && memcmp(p, "\"instance\"", 10) == 0)) {
+            key = hash_bytes(p, key_len, key ? key : 2166136261u);
+            key = hash_bytes(value, value_end - value, key);
+            if (is_name) {
+                id->name = value;
+                id->name_len = value_end - value;
+            } else {
+                id->instance = value;
+                id->instance_len = value_end - value;
+            }
+        }
+
+        p = json_skip_ws(value_end, end);
+        if (p < end && *p == ',')
+            p = json_skip_ws(p + 1, end);
+    }
+    return key;
+}
+
+/* Parse one i3bar block object at p into block. full_text becomes the
+ * text, color, background and border the text, background and underline
+ * colors, and name the block id. Other keys are ignored. */
+static char *json_parse_block(char *p, char *end, struct text_block *block,
+        struct color_cache *colors) {
+    static char empty[] = "";
+
+    memset(block, 0, sizeof(*block));
+    block->text = empty;
+    block->fg_color = COLOR_WHITE;
+    bool has_underline_color = false;
+
+    p = json_skip_ws(p + 1, end);
+    while (p < end && *p != '}') {
+        char *key, *value;
+        p = json_string(p, end, &key);
+        if (!p)
+            return NULL;
+        p = json_skip_ws(p, end);
+        if (p >= end || *p != ':')
+            return NULL;
+        p = json_skip_ws(p + 1, end);
+
+        if (p < end && *p == '"') {
+            p = json_string(p, end, &value);
+            if (!p)
+                return NULL;
+            if (strcmp(key, "full_text") == 0) {
+                block->text = value;
+            } else if (strcmp(key, "color") == 0) {
+                block->fg_color = resolve_color(colors, value);
+            } else if (strcmp(key, "background") == 0) {
+                block->bg_color = resolve_color(colors, value);
+            } else if (strcmp(key, "border") == 0) {
+                block->underline_color = resolve_color(colors, value);
+                block->underline = true;
+                has_underline_color = true;
+            } else if (strcmp(key, "name") == 0) {
+                block->id = value;
+            }
+        } else {
+            p = json_skip_value(p, end);
+            if (!p)
+                return NULL;
+        }
+
+        p = json_skip_ws(p, end);
+        if (p < end && *p == ',')
+            p = json_skip_ws(p + 1, end);
+    }
+    if (p >= end)
+        return NULL;
+
+    if (!has_underline_color)
+        block->underline_color = block->fg_color;
+    return p + 1;
+}
+
+/* What one block put on screen. Buffers remember the cells they hold, so
+ * the next frame painted into one only repaints cells that differ. */
+struct drawn_cell {
+    int x0, x1;             // Horizontal extent, padding included
+    int text_x, text_y;
+    const char *text;       // Owned by whoever keeps the cell
+    size_t text_len;
+    uint32_t text_hash;
+    int font_index;
+    uint32_t fg_color;
+    uint32_t bg_color;
+    uint32_t underline_color;
+    bool underline;
+    bool is_separator;
+    bool scrolling;         // Marquee text wider than the block
+    int scroll_x;           // How far the marquee text has moved
+    bool in_subsurface;     // Drawn on a block surface, not the bar
+};
+
+/* Horizontal spans of the bar that need work; a span covers the full bar
+ * height. */
+struct damage_span {
+    int x0, x1;
+};
+
+struct damage {
+    struct damage_span *spans;
+    size_t count;
+    size_t cap;
+};
+
+/* A block or separator placed for the frame being drawn. */
+struct frame_block {
+    struct drawn_cell cell;
+    int block_index;        // Index into the blocks, -1 for a separator
+    struct text_block *block;
+    PangoLayout *layout;
+    int width;              // Text width, padding excluded
+    struct marquee_strip *strip;    // Scrolling text, NULL if static
+    struct glyph_atlas *atlas;      // Cells the text is composed from, NULL if shaped
+};
+
+/* Marquee text rendered once, followed by a gap, into a strip as tall as
+ * the bar. Every animation frame blits a window of it, wrapping around. */
+#define MARQUEE_GAP 40          // Logical pixels between the end and the next start
+#define MARQUEE_SPEED 30        // Logical pixels per second
+
+struct marquee_strip {
+    char *text;
+    uint32_t text_hash;
+    int font_index;
+    uint32_t fg_color;
+    int text_y;
+    int scale;
+    int width;              // Text plus gap; one scroll period
+    cairo_surface_t *surface;
+    uint64_t start_ns;      // When the text started scrolling
+    unsigned long frame;    // Layout frame that last used it
+};
+
+/* N= blocks show numbers with tabular figures from a strip of pre-rendered
+ * glyph cells, one strip per font, colors and pixel format. Cells already
+ * hold the block background and what is below it, so a frame composes the
+ * text with a row of memcpy()s and never shapes it. */
+#define ATLAS_GLYPHS "0123456789.%: "
+#define NUM_ATLAS_GLYPHS (sizeof(ATLAS_GLYPHS) - 1)
+#define GLYPH_ATLAS_MAX 8
+
+struct glyph_atlas {
+    int font_index;
+    uint32_t fg_color;
+    uint32_t bg_color;
+    uint32_t under_color;   // What the cells are drawn over
+    cairo_format_t format;
+    int scale;
+    int height;
+    int cell_width;
+    int text_height;
+    cairo_surface_t *surface;
+    unsigned char *data;
+    int stride;
+    unsigned long frame;    // Layout frame that last used it
+};
+
+/* Blocks are laid out in three runs: left, center and right. */
+enum {
+    SEGMENT_LEFT,
+    SEGMENT_CENTER,
+    SEGMENT_RIGHT,
+    NUM_SEGMENTS
+};
+
+struct segment {
+    size_t first;           // First cell in the frame
+    size_t end;             // One past the last cell
+};
+
+/* Rendered blocks keyed by everything that affects their pixels. Bars that
+ * cycle through a few states (workspaces, volume, battery) repaint a
+ * changed block with a single blit once each state has been seen. */
+#define DEFAULT_BLOCK_CACHE_KIB 2048
+
+struct block_cache_entry {
+    char *text;
+    size_t len;
+    uint32_t text_hash;
+    int font_index;
+    uint32_t fg_color;
+    uint32_t bg_color;
+    uint32_t underline_color;
+    bool underline;
+    int width, height;      // Cell size
+    int text_x, text_y;     // Text origin within the cell
+    int scale;
+    cairo_surface_t *surface;
+    size_t bytes;
+    unsigned long last_used;
+};
+
+struct block_cache {
+    struct block_cache_entry *entries;
+    size_t count;
+    size_t cap;
+    size_t bytes;           // Pixel memory held by all entries
+    size_t budget;          // 0 disables the cache
+    unsigned long tick;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+/* Stdin is consumed in reads of up to READ_CHUNK bytes; a single line longer
+ * than MAX_LINE_LENGTH is dropped rather than buffered forever. */
+#define READ_CHUNK (64 * 1024)
+#define MAX_LINE_LENGTH (1024 * 1024)
+
+/* Growable byte buffer that frames stdin into lines. Reads append at the
+ * tail, complete lines are consumed from the head and a partial line is
+ * carried over until the rest of it arrives. */
+struct line_reader {
+    char *data;
+    size_t start;   // First unconsumed byte
+    size_t len;     // Unconsumed bytes from start
+    size_t cap;
+    bool discard;   // Skipping the rest of an overlong line
+    unsigned long lines;    // Complete lines consumed
+};
+
+/* A block owned by a control socket producer, kept across stdin lines until
+ * it is removed. Each one parses into its own arena, so updating it never
+ * touches the other blocks. */
+struct socket_block {
+    char *id;
+    struct arena arena;
+    struct text_block block;
+    bool text_only;             // Only replaces the text of its stdin block
+    bool in_line;               // Shown in place of a stdin block
+    ssize_t index;              // Position in bar->blocks, -1 if not shown
+};
+
+/* A block command run by limebar itself, i3blocks style. Its newest output
+ * line becomes the text of socket block id. */
+struct command_block {
+    char *id;
+    char *command;
+    int interval;               // Seconds between runs, 0 to keep it running
+    pid_t pid;                  // 0 when not running
+    int pidfd;                  // -1 when not running
+    int out_fd;                 // Read end of its stdout, -1 once closed
+    int timer_fd;
+    bool periodic;              // timer_fd runs on interval, not a backoff
+    struct line_reader output;
+    char *last_line;            // The last line shown
+    size_t last_line_len;
+    size_t last_line_cap;
+    int failures;               // Consecutive failed runs
+    uint64_t started_ns;
+};
+
+/* Clients connected to the control socket. */
+#define MAX_CONTROL_CLIENTS 8
+
+struct control_client {
+    int fd;                     // -1 when the slot is free
+    struct line_reader input;
+};
+
+/* Where the i3bar stream scanner is between reads. */
+struct json_stream {
+    size_t scanned;         // Bytes from the reader's start already scanned
+    size_t status_start;    // Offset of the status array being scanned
+    int depth;
+    bool in_body;           // Inside the endless array
+    bool in_string;
+    bool escape;
+};
+
+/* A JSON block with a name, kept from status to status. While its object
+ * is byte for byte the same it isn't parsed again. */
+struct json_block {
+    uint32_t key;           // Hash of name and instance
+    char *id;               // Name followed by instance, as in the status
+    size_t name_len;
+    size_t instance_len;
+    uint32_t hash;          // Hash of the object's text
+    const char *object;     // The object's text, in arena
+    size_t object_len;
+    bool valid;             // block holds what the object parsed to
+    unsigned long seen;     // Last status it appeared in
+    struct arena arena;
+    struct text_block block;
+};
+
+struct limebar;
+struct bar_output;
+
+struct pool_buffer {
+    struct wl_buffer *buffer;
+    cairo_surface_t *cairo_surface;
+    cairo_t *cairo;
+    void *data;
+    uint32_t width;
+    uint32_t height;
+    size_t offset;          // Where the view starts in the pool
+    size_t size;
+    bool created;
+    bool busy;              // Held by the compositor until release
+    bool valid;             // cells describe what the buffer holds
+    struct drawn_cell *cells;
+    size_t num_cells;
+    size_t cells_cap;
+    struct arena cell_text; // Text of the cells
+    struct bar_output *output;
+};
+
+/* A view dropped by a resize while the compositor still held it. Its bytes
+ * in the pool stay untouched until the release, when the view goes. */
+struct retired_buffer {
+    struct wl_buffer *buffer;
+    size_t offset;
+    size_t size;
+};
+
+/* With --render-thread, layout and rasterization run on a worker while the
+ * main thread keeps reading input and dispatching Wayland events. The two
+ * hand work to each other through single-producer single-consumer rings;
+ * a producer that finds its ring full would have to wait, which the fixed
+ * number of jobs in flight rules out. */
+#define SPSC_QUEUE_SIZE 4       // Power of two
+
+struct spsc_queue {
+    void *slots[SPSC_QUEUE_SIZE];
+    _Atomic size_t head;        // Next slot to pop, moved by the consumer
+    _Atomic size_t tail;        // Next slot to push, moved by the producer
+};
+
+/* A copy of the blocks to show, text included, so the main thread can parse
+ * the next line while the worker lays this one out. */
+#define RENDER_JOBS SPSC_QUEUE_SIZE
+
+struct render_job {
+    struct arena arena;
+    struct text_block *blocks;
+    size_t num_blocks;
+};
+
+struct render_result {
+    bool changed;               // The buffer holds a new frame to commit
+    uint64_t stage_ns[NUM_STAGES];
+};
+
+/* Between a grant and its result the worker owns the layout, caches,
+ * buffer cells and damage; the rest of the time the main thread does. */
+struct render_thread {
+    pthread_t thread;
+    bool running;
+    int wake_fd;                // eventfd the worker sleeps on
+    int done_fd;                // eventfd in the main loop
+    atomic_bool stop;
+    atomic_bool reload;         // Drop fonts and caches before the next frame
+    struct spsc_queue jobs;     // Main to worker: blocks, newest last
+    struct spsc_queue grants;   // Main to worker: a released buffer to draw into
+    struct spsc_queue done;     // Worker to main: the result for the grant
+    struct spsc_queue retired;  // Worker to main: jobs it is done with
+    struct render_job job_storage[RENDER_JOBS];
+    struct render_job *free_jobs[RENDER_JOBS];
+    size_t num_free_jobs;
+    struct render_result result;
+    struct pool_buffer *granted;    // Out with the worker, NULL if idle
+};
+
+/* Scales are kept in 120ths, the way wp_fractional_scale_v1 sends them, so
+ * 1.5 is 180. Sizes on the command line are in logical pixels; frames are
+ * laid out and drawn in the device pixels of their output. */
+#define SCALE_ONE 120
+
+static int scale_px(int scale, int logical) {
+    return (logical * scale + SCALE_ONE / 2) / SCALE_ONE;
+}
+
+/* Command line sizes in device pixels of the output being drawn. */
+struct bar_metrics {
+    int padding;
+    int margin_top;
+    int margin_bottom;
+    int margin_left;
+    int margin_right;
+    int underline_thickness;
+    int marquee_gap;
+};
+
+/* The fonts with their sizes multiplied by one scale. */
+struct scaled_fonts {
+    int scale;
+    PangoFontDescription **descs;
+};
+
+/* A bar on one wl_output. Every output shows the same blocks, and shaped
+ * layouts and rendered blocks come from the caches they share; an output
+ * only has its own surface, buffers and frame pacing. Headless rendering
+ * draws into a single output without a wl_output. */
+struct bar_output {
+    struct limebar *bar;
+    uint32_t name;              // Registry name of wl_output, 0 if headless
+    struct wl_output *wl_output;
+    struct wl_surface *surface;
+    struct zwlr_layer_surface_v1 *layer_surface;
+    struct wp_viewport *viewport;   // Maps device sized buffers onto the surface
+    struct wp_fractional_scale_v1 *fractional_scale;
+    uint32_t width;             // Logical size from configure
+    uint32_t height;
+    int32_t output_scale;       // From wl_output.scale
+    uint32_t preferred_scale;   // From wp_fractional_scale_v1, 0 until sent
+    int scale;                  // Frames are drawn at, in 120ths
+    struct pool_buffer buffers[NUM_BUFFERS];
+    struct retired_buffer *retired;     // Old views not yet released
+    size_t num_retired;
+    size_t retired_cap;
+    int shm_fd;                 // memfd backing the pool, -1 until first configure
+    struct wl_shm_pool *shm_pool;
+    void *shm_data;
+    size_t shm_size;
+    struct wl_callback *frame_callback;  // Outstanding wl_surface.frame
+    bool dirty;                 // Blocks changed since the last committed frame
+    uint64_t last_frame_ns;     // When the last frame was drawn
+    struct pool_buffer *last_buffer;    // Last buffer committed to the surface
+    struct block_surface **block_surfaces;  // Subsurfaces of S blocks
+    size_t num_block_surfaces;
+    size_t block_surfaces_cap;
+};
+
+struct limebar {
+    struct wl_display *display;
+    struct wl_registry *registry;
+    struct wl_compositor *compositor;
+    struct wl_subcompositor *subcompositor;
+    struct wl_shm *shm;
+    struct zwlr_layer_shell_v1 *layer_shell;
+    struct wp_viewporter *viewporter;
+    struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
+    struct bar_output **outputs;
+    size_t num_outputs;
+    size_t outputs_cap;
+    bool outputs_live;          // New outputs get a layer surface right away
+    struct bar_output *output;  // Output the current frame is for
+    uint32_t width;             // Its size in device pixels
+    uint32_t height;
+    int scale;                  // Its scale
+    struct bar_metrics metrics;
+    PangoFontDescription **frame_fonts;     // font_descs sized for its scale
+    uint64_t min_frame_ns;      // From --max-fps, 0 when uncapped
+    struct stats stats;
+    uint64_t next_stats_ns;     // When --stats prints next
+    int control_fd;             // Listening control socket, -1 if none
+    int epoll_fd;               // Event loop, -1 outside run_wayland
+    int timer_fd;               // Fires for held back frames and --stats
+    uint64_t timer_deadline;    // What timer_fd is armed for, 0 if disarmed
+    int signal_fd;
+    bool running;
+    struct control_client clients[MAX_CONTROL_CLIENTS];
+    struct module modules[NUM_MODULES];
+    uint32_t module_refs;       // Modules the current line references
+    char *line;                 // Copy of the current line while it references modules
+    size_t line_len;
+    size_t line_cap;
+    PangoContext *pango_context;
+    PangoFontDescription **font_descs;  // Parsed once from fonts
+    struct scaled_fonts *scaled_fonts;  // For scales other than one
+    size_t num_scaled_fonts;
+    size_t scaled_fonts_cap;
+    struct layout_cache layouts;
+    struct block_cache block_cache;
+    bool opaque;                // Background alpha is 1, so is every pixel
+    cairo_format_t format;      // Buffer pixel format
+    uint32_t shm_format;        // The same format as wl_shm knows it
+    bool shm_rgb565;            // Compositor accepts RGB565 buffers
+    struct marquee_strip **strips;
+    size_t num_strips;
+    size_t strips_cap;
+    bool animating;             // A marquee is scrolling
+    struct glyph_atlas **atlases;
+    size_t num_atlases;
+    size_t atlases_cap;
+    struct frame_block *frame;  // Cells placed for the frame being drawn
+    size_t num_frame;
+    size_t frame_cap;
+    struct segment segments[NUM_SEGMENTS];
+    unsigned char *block_segments;  // Each block's segment when they were built
+    size_t num_block_segments;
+    size_t block_segments_cap;
+    bool segments_valid;
+    struct damage repaint;      // Spans repainted into the current buffer
+    struct damage surface_damage;   // Spans changed on screen
+    struct text_block *blocks;  // What is shown: line_blocks or block_list
+    size_t num_blocks;
+    bool blocks_changed;        // Since the render thread got a copy
+    struct text_block *frame_src;   // Blocks the frame is laid out from
+    size_t num_frame_src;
+    struct render_thread render;
+    struct text_block *line_blocks; // Parsed from the last line into block_arena
+    size_t num_line_blocks;
+    struct arena block_arena;
+    struct text_block *block_list;  // line_blocks merged with socket_blocks
+    size_t block_list_cap;
+    struct socket_block *socket_blocks;
+    size_t num_socket_blocks;
+    size_t socket_blocks_cap;
+    struct command_block *commands;
+    int num_commands;
+    struct json_stream json;
+    struct json_block *json_blocks;
+    size_t num_json_blocks;
+    size_t json_blocks_cap;
+    unsigned long json_status;  // Statuses parsed
+    char *json_line;            // The last status
+    size_t json_line_len;
+    size_t json_line_cap;
+    struct line_reader input;
+    char **fonts;
+    int num_fonts;
+
+      struct bar_config *config;  // Add this
+
+    uint32_t background;        // Bar background with opacity applied
+    uint32_t text_color;        // Raw mode text color
+    struct color_cache colors;
+};
+
+static void registry_global(void *data, struct wl_registry *registry,
+        uint32_t name, const char *interface, uint32_t version);
+static void registry_global_remove(void *data,
+        struct wl_registry *registry, uint32_t name);
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+/* Make room for count elements of size bytes, growing geometrically. */
+static void *grow_array(void *array, size_t *cap, size_t count, size_t size) {
+    if (count <= *cap)
+        return array;
+
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < count)
+        new_cap *= 2;
+
+    array = realloc(array, new_cap * size);
+    if (!array) {
+        fprintf(stderr, "Failed to grow array: %s\n", strerror(errno));
+        exit(1);
+    }
+    *cap = new_cap;
+    return array;
+}
+
+static void render_frame(struct limebar *bar);
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+    struct pool_buffer *buf = data;
+    struct bar_output *output = buf->output;
+
+    // A view from before a resize that used this slot; its range is free now
+    if (wl_buffer != buf->buffer) {
+        for (size_t i = 0; i < output->num_retired; i++) {
+            if (output->retired[i].buffer != wl_buffer)
+                continue;
+            wl_buffer_destroy(wl_buffer);
+            output->retired[i] = output->retired[--output->num_retired];
+            break;
+        }
+        return;
+    }
+
+    buf->busy = false;
+
+    // Content arrived while every buffer was held; paint it now
+    if (output->dirty && !output->frame_callback)
+        render_frame(output->bar);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
+
+/* Make the shm pool at least size bytes. The pool is a sealed memfd that
+ * only ever grows, so reconfigures that fit reuse the mapping and the
+ * wl_shm_pool as they are. */
+static void shm_pool_reserve(struct bar_output *output, size_t size) {
+    if (size <= output->shm_size)
+        return;
+
+    if (output->shm_fd < 0) {
+        output->shm_fd = memfd_create("limebar", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (output->shm_fd < 0) {
+            fprintf(stderr, "Failed to create memfd: %s\n", strerror(errno));
+            exit(1);
+        }
+        // The compositor maps this too; promise it never shrinks under it
+        fcntl(output->shm_fd, F_ADD_SEALS, F_SEAL_SHRINK);
+    }
+
+    if (ftruncate(output->shm_fd, size) == -1) {
+        fprintf(stderr, "Failed to set file size: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, output->shm_fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (output->shm_data)
+        munmap(output->shm_data, output->shm_size);
+    output->shm_data = data;
+    output->shm_size = size;
+
+    // Headless rendering uses the memory without a wl_shm_pool
+    if (output->shm_pool)
+        wl_shm_pool_resize(output->shm_pool, size);
+    else if (output->bar->shm)
+        output->shm_pool = wl_shm_create_pool(output->bar->shm, output->shm_fd, size);
+}
+
+/* An opaque bar needs no alpha channel: XRGB buffers, or RGB565 with
+ * --rgb565 when the compositor supports it, let the compositor skip
+ * blending. Translucent bars keep ARGB. */
+static void pick_format(struct limebar *bar) {
+    bar->opaque = (bar->background >> 24) == 0xff;
+    if (!bar->opaque) {
+        if (bar->config->rgb565)
+            fprintf(stderr, "--rgb565 needs an opaque background, using ARGB\n");
+        bar->format = CAIRO_FORMAT_ARGB32;
+        bar->shm_format = WL_SHM_FORMAT_ARGB8888;
+    } else if (bar->config->rgb565 && (bar->shm_rgb565 || !bar->shm)) {
+        bar->format = CAIRO_FORMAT_RGB16_565;
+        bar->shm_format = WL_SHM_FORMAT_RGB565;
+    } else {
+        bar->format = CAIRO_FORMAT_RGB24;
+        bar->shm_format = WL_SHM_FORMAT_XRGB8888;
+    }
+}
+
+/* Make buffers for the output's logical size at its scale. */
+static void create_buffers(struct bar_output *output) {
+    struct limebar *bar = output->bar;
+    uint32_t width = scale_px(output->scale, output->width);
+    uint32_t height = scale_px(output->scale, output->height);
+    pick_format(bar);
+    int stride = cairo_format_stride_for_width(bar->format, width);
+    size_t buffer_size = (size_t)stride * height;
+
+    // Views the compositor still holds keep their bytes, so the new ones
+    // go past them
+    size_t base = 0;
+    for (size_t i = 0; i < output->num_retired; i++) {
+        size_t end = output->retired[i].offset + output->retired[i].size;
+        if (end > base)
+            base = end;
+    }
+    shm_pool_reserve(output, base + buffer_size * NUM_BUFFERS);
+
+    // NUM_BUFFERS views at consecutive offsets of the one pool
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        struct pool_buffer *buf = &output->buffers[i];
+        buf->output = output;
+        buf->busy = false;
+        buf->width = width;
+        buf->height = height;
+        buf->offset = base + buffer_size * i;
+        buf->size = buffer_size;
+        buf->data = (char *)output->shm_data + buf->offset;
+        buf->created = true;
+        if (output->shm_pool) {
+            buf->buffer = wl_shm_pool_create_buffer(output->shm_pool, buf->offset,
+                    width, height, stride, bar->shm_format);
+            wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+        }
+
+        buf->cairo_surface = cairo_image_surface_create_for_data(buf->data,
+                bar->format, width, height, stride);
+        buf->cairo = cairo_create(buf->cairo_surface);
+    }
+}
+
+/* Drop the buffer views; the pool and its mapping stay for the next size.
+ * Views the compositor still holds are retired rather than destroyed, so
+ * create_buffers() keeps clear of their bytes until they are released. */
+static void destroy_buffers(struct bar_output *output) {
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        struct pool_buffer *buf = &output->buffers[i];
+        if (buf->cairo)
+            cairo_destroy(buf->cairo);
+        if (buf->cairo_surface)
+            cairo_surface_destroy(buf->cairo_surface);
+        if (buf->buffer && buf->busy) {
+            output->retired = grow_array(output->retired, &output->retired_cap,
+                    output->num_retired + 1, sizeof(*output->retired));
+            output->retired[output->num_retired++] = (struct retired_buffer){
+                .buffer = buf->buffer,
+                .offset = buf->offset,
+                .size = buf->size,
+            };
+        } else if (buf->buffer) {
+            wl_buffer_destroy(buf->buffer);
+        }
+        free(buf->cells);
+        free(buf->cell_text.data);
+        memset(buf, 0, sizeof(*buf));
+    }
+    output->last_buffer = NULL;
+}
+
+static void destroy_shm_pool(struct bar_output *output) {
+    // Retired views go with the pool they point into
+    for (size_t i = 0; i < output->num_retired; i++)
+        wl_buffer_destroy(output->retired[i].buffer);
+    free(output->retired);
+    output->retired = NULL;
+    output->num_retired = 0;
+    output->retired_cap = 0;
+    if (output->shm_pool)
+        wl_shm_pool_destroy(output->shm_pool);
+    if (output->shm_data)
+        munmap(output->shm_data, output->shm_size);
+    if (output->shm_fd >= 0)
+        close(output->shm_fd);
+    output->shm_pool = NULL;
+    output->shm_data = NULL;
+    output->shm_size = 0;
+    output->shm_fd = -1;
+}
+
+static struct pool_buffer *get_free_buffer(struct bar_output *output) {
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        struct pool_buffer *buf = &output->buffers[i];
+        if (buf->created && !buf->busy)
+            return buf;
+    }
+    return NULL;
+}
+
+static void damage_add(struct damage *damage, int x0, int x1) {
+    if (x1 <= x0)
+        return;
+    damage->spans = grow_array(damage->spans, &damage->cap,
+            damage->count + 1, sizeof(*damage->spans));
+    damage->spans[damage->count++] = (struct damage_span){x0, x1};
+}
+
+static int compare_spans(const void *a, const void *b) {
+    const struct damage_span *sa = a, *sb = b;
+    return (sa->x0 > sb->x0) - (sa->x0 < sb->x0);
+}
+
+/* Clamp spans to the bar and merge the ones that touch. */
+static void damage_normalize(struct damage *damage, int width) {
+    qsort(damage->spans, damage->count, sizeof(*damage->spans), compare_spans);
+
+    size_t out = 0;
+    for (size_t i = 0; i < damage->count; i++) {
+        struct damage_span span = damage->spans[i];
+        if (span.x0 < 0) span.x0 = 0;
+        if (span.x1 > width) span.x1 = width;
+        if (span.x1 <= span.x0)
+            continue;
+
+        if (out > 0 && span.x0 <= damage->spans[out - 1].x1) {
+            if (span.x1 > damage->spans[out - 1].x1)
+                damage->spans[out - 1].x1 = span.x1;
+        } else {
+            damage->spans[out++] = span;
+        }
+    }
+    damage->count = out;
+}
+
+static bool damage_intersects(const struct damage *damage, int x0, int x1) {
+    for (size_t i = 0; i < damage->count; i++) {
+        if (damage->spans[i].x0 < x1 && x0 < damage->spans[i].x1)
+            return true;
+    }
+    return false;
+}
+
+static bool cells_equal(const struct drawn_cell *a, const struct drawn_cell *b) {
+    return a->x0 == b->x0 && a->x1 == b->x1 &&
+        a->text_x == b->text_x && a->text_y == b->text_y &&
+        a->text_hash == b->text_hash && a->text_len == b->text_len &&
+        a->font_index == b->font_index &&
+        a->fg_color == b->fg_color && a->bg_color == b->bg_color &&
+        a->underline_color == b->underline_color &&
+        a->underline == b->underline && a->is_separator == b->is_separator &&
+        a->scrolling == b->scrolling && a->scroll_x == b->scroll_x &&
+        a->in_subsurface == b->in_subsurface &&
+        (a->text_len == 0 || memcmp(a->text, b->text, a->text_len) == 0);
+}
+
+/* Damage the extent of every cell in the frame that is not identical in old,
+ * and of every old cell that the frame no longer has. Both lists are sorted
+ * left to right. */
+static void damage_diff(struct damage *damage, const struct frame_block *frame,
+        size_t num_frame, const struct drawn_cell *old, size_t num_old) {
+    size_t j = 0;
+    for (size_t i = 0; i < num_frame; i++) {
+        const struct drawn_cell *cell = &frame[i].cell;
+        while (j < num_old && old[j].x0 < cell->x0)
+            j++;
+        if (j >= num_old || !cells_equal(cell, &old[j]))
+            damage_add(damage, cell->x0, cell->x1);
+    }
+
+    j = 0;
+    for (size_t i = 0; i < num_old; i++) {
+        while (j < num_frame && frame[j].cell.x0 < old[i].x0)
+            j++;
+        if (j >= num_frame || !cells_equal(&old[i], &frame[j].cell))
+            damage_add(damage, old[i].x0, old[i].x1);
+    }
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+    struct bar_output *output = data;
+    (void)time;
+
+    wl_callback_destroy(callback);
+    output->frame_callback = NULL;
+
+    // Marquees advance once per frame the compositor asks for
+    if (output->bar->animating)
+        output->dirty = true;
+
+    // The compositor is ready for another frame; show the newest blocks
+    if (output->dirty)
+        render_frame(output->bar);
+}
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+/* Resolve where a block goes; blocks without an A= attribute follow -a. */
+static int block_segment(const struct limebar *bar, const struct text_block *block) {
+    switch (block->alignment) {
+        case ALIGN_LEFT:
+            return SEGMENT_LEFT;
+        case ALIGN_CENTER:
+            return SEGMENT_CENTER;
+        case ALIGN_RIGHT:
+            return SEGMENT_RIGHT;
+        default:
+            break;
+    }
+    switch (bar->config->default_alignment) {
+        case ALIGN_DEFAULT_CENTER:
+            return SEGMENT_CENTER;
+        case ALIGN_DEFAULT_RIGHT:
+            return SEGMENT_RIGHT;
+        default:
+            return SEGMENT_LEFT;
+    }
+}
+
+/* Rebuild the order of cells in bar->frame: left, center and right
+ * segments, each holding its blocks in input order with a separator cell
+ * between neighbours. */
+static void build_segments(struct limebar *bar) {
+    size_t max_cells = bar->num_frame_src * 2;
+    bar->frame = grow_array(bar->frame, &bar->frame_cap, max_cells, sizeof(*bar->frame));
+    bar->num_frame = 0;
+
+    for (int seg = 0; seg < NUM_SEGMENTS; seg++) {
+        bar->segments[seg].first = bar->num_frame;
+        for (size_t i = 0; i < bar->num_frame_src; i++) {
+            if (block_segment(bar, &bar->frame_src[i]) != seg)
+                continue;
+
+            if (bar->num_frame > bar->segments[seg].first && bar->config->separator) {
+                bar->frame[bar->num_frame++] = (struct frame_block){
+                    .block_index = -1,
+                };
+            }
+            bar->frame[bar->num_frame++] = (struct frame_block){
+                .block_index = i,
+            };
+        }
+        bar->segments[seg].end = bar->num_frame;
+    }
+
+    // Remember what the cells were built for
+    bar->block_segments = grow_array(bar->block_segments, &bar->block_segments_cap,
+            bar->num_frame_src, 1);
+    for (size_t i = 0; i < bar->num_frame_src; i++)
+        bar->block_segments[i] = block_segment(bar, &bar->frame_src[i]);
+    bar->num_block_segments = bar->num_frame_src;
+}
+
+/* Whether the cells are still right for the blocks: build_segments() only
+ * depends on the block count and each block's segment. */
+static bool segments_match(const struct limebar *bar) {
+    if (bar->num_block_segments != bar->num_frame_src)
+        return false;
+    for (size_t i = 0; i < bar->num_frame_src; i++) {
+        if (bar->block_segments[i] != block_segment(bar, &bar->frame_src[i]))
+            return false;
+    }
+    return true;
+}
+
+static int text_y_for_height(const struct limebar *bar, int height) {
+    // Vertically center the text
+    int y = (bar->height - height) / 2;
+    if (bar->config->position == POSITION_TOP) {
+        y += bar->metrics.margin_top;
+    } else {
+        y += bar->metrics.margin_bottom;
+    }
+    return y;
+}
+
+/* Find or render the strip for a scrolling block. */
+static struct marquee_strip *marquee_strip_get(struct limebar *bar, const struct frame_block *fb,
+        int text_width) {
+    const struct drawn_cell *cell = &fb->cell;
+    for (size_t i = 0; i < bar->num_strips; i++) {
+        struct marquee_strip *strip = bar->strips[i];
+        if (strip->text_hash == cell->text_hash && strip->font_index == cell->font_index &&
+                strip->fg_color == cell->fg_color && strip->text_y == cell->text_y &&
+                strip->scale == bar->scale && strcmp(strip->text, fb->block->text) == 0) {
+            strip->frame = bar->layouts.frame;
+            return strip;
+        }
+    }
+
+    struct marquee_strip *strip = malloc(sizeof(*strip));
+    *strip = (struct marquee_strip){
+        .text = strdup(fb->block->text),
+        .text_hash = cell->text_hash,
+        .font_index = cell->font_index,
+        .fg_color = cell->fg_color,
+        .text_y = cell->text_y,
+        .scale = bar->scale,
+        .width = text_width + bar->metrics.marquee_gap,
+        .start_ns = now_ns(),
+        .frame = bar->layouts.frame,
+    };
+    strip->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, strip->width, bar->height);
+    cairo_t *cr = cairo_create(strip->surface);
+    set_source_color(cr, cell->fg_color);
+    cairo_move_to(cr, 0, cell->text_y);
+    pango_cairo_show_layout(cr, fb->layout);
+    cairo_destroy(cr);
+    cairo_surface_flush(strip->surface);
+
+    bar->strips = grow_array(bar->strips, &bar->strips_cap, bar->num_strips + 1,
+            sizeof(*bar->strips));
+    bar->strips[bar->num_strips++] = strip;
+    return strip;
+}
+
+static void marquee_strip_free(struct marquee_strip *strip) {
+    cairo_surface_destroy(strip->surface);
+    free(strip->text);
+    free(strip);
+}
+
+/* Drop the strips of marquees that are gone. */
+static void marquee_strips_expire(struct limebar *bar) {
+    for (size_t i = 0; i < bar->num_strips; ) {
+        if (bar->strips[i]->frame == bar->layouts.frame) {
+            i++;
+            continue;
+        }
+        marquee_strip_free(bar->strips[i]);
+        bar->strips[i] = bar->strips[--bar->num_strips];
+    }
+}
+
+static int atlas_glyph(char c) {
+    const char *glyph = c ? strchr(ATLAS_GLYPHS, c) : NULL;
+    return glyph ? glyph - ATLAS_GLYPHS : -1;
+}
+
+static bool atlas_text(const char *text) {
+    for (; *text; text++) {
+        if (atlas_glyph(*text) < 0)
+            return false;
+    }
+    return true;
+}
+
+static void glyph_atlas_free(struct glyph_atlas *atlas) {
+    cairo_surface_destroy(atlas->surface);
+    free(atlas);
+}
+
+/* Return the atlas for a font and colors, rendering it on first use. Every
+ * cell is as wide as the widest glyph, so the text never changes width. */
+static struct glyph_atlas *glyph_atlas_get(struct limebar *bar, int font_index,
+        uint32_t fg_color, uint32_t bg_color, uint32_t under_color, cairo_format_t format) {
+    for (size_t i = 0; i < bar->num_atlases; i++) {
+        struct glyph_atlas *atlas = bar->atlases[i];
+        if (atlas->font_index == font_index && atlas->fg_color == fg_color &&
+                atlas->bg_color == bg_color && atlas->under_color == under_color &&
+                atlas->format == format && atlas->scale == bar->scale &&
+                atlas->height == (int)bar->height) {
+            atlas->frame = bar->layouts.frame;
+            return atlas;
+        }
+    }
+
+    // Make room by dropping the least recently used atlases, but never one
+    // an earlier block of this frame still composes from
+    while (bar->num_atlases >= GLYPH_ATLAS_MAX) {
+        size_t oldest = bar->num_atlases;
+        for (size_t i = 0; i < bar->num_atlases; i++) {
+            if (bar->atlases[i]->frame == bar->layouts.frame)
+                continue;
+            if (oldest == bar->num_atlases || bar->atlases[i]->frame < bar->atlases[oldest]->frame)
+                oldest = i;
+        }
+        if (oldest == bar->num_atlases)
+            break;
+        glyph_atlas_free(bar->atlases[oldest]);
+        bar->atlases[oldest] = bar->atlases[--bar->num_atlases];
+    }
+
+    PangoLayout *layout = pango_layout_new(bar->pango_context);
+    pango_layout_set_font_description(layout, bar->frame_fonts[font_index]);
+    PangoAttrList *attrs = pango_attr_list_new();
+    pango_attr_list_insert(attrs, pango_attr_font_features_new("tnum 1"));
+    pango_layout_set_attributes(layout, attrs);
+    pango_attr_list_unref(attrs);
+
+    int widths[NUM_ATLAS_GLYPHS];
+    int cell_width = 0, text_height = 0;
+    for (size_t i = 0; i < NUM_ATLAS_GLYPHS; i++) {
+        int height;
+        pango_layout_set_text(layout, &ATLAS_GLYPHS[i], 1);
+        pango_layout_get_pixel_size(layout, &widths[i], &height);
+        if (widths[i] > cell_width)
+            cell_width = widths[i];
+        if (height > text_height)
+            text_height = height;
+    }
+    if (cell_width < 1)
+        cell_width = 1;
+
+    struct glyph_atlas *atlas = malloc(sizeof(*atlas));
+    *atlas = (struct glyph_atlas){
+        .font_index = font_index,
+        .fg_color = fg_color,
+        .bg_color = bg_color,
+        .under_color = under_color,
+        .format = format,
+        .scale = bar->scale,
+        .height = bar->height,
+        .cell_width = cell_width,
+        .text_height = text_height,
+        .frame = bar->layouts.frame,
+    };
+    atlas->surface = cairo_image_surface_create(format,
+            cell_width * NUM_ATLAS_GLYPHS, bar->height);
+
+    // Paint exactly what draw() and draw_block() would put there
+    cairo_t *cr = cairo_create(atlas->surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    set_source_color(cr, under_color);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    if (bg_color >> 24) {
+        set_source_color(cr, bg_color);
+        cairo_rectangle(cr, 0, bar->metrics.margin_top, cell_width * NUM_ATLAS_GLYPHS,
+            bar->height - bar->metrics.margin_top - bar->metrics.margin_bottom);
+        cairo_fill(cr);
+    }
+    set_source_color(cr, fg_color);
+    int text_y = text_y_for_height(bar, text_height);
+    for (size_t i = 0; i < NUM_ATLAS_GLYPHS; i++) {
+        pango_layout_set_text(layout, &ATLAS_GLYPHS[i], 1);
+        cairo_move_to(cr, i * cell_width + (cell_width - widths[i]) / 2, text_y);
+        pango_cairo_show_layout(cr, layout);
+    }
+    cairo_destroy(cr);
+    g_object_unref(layout);
+    cairo_surface_flush(atlas->surface);
+    atlas->data = cairo_image_surface_get_data(atlas->surface);
+    atlas->stride = cairo_image_surface_get_stride(atlas->surface);
+
+    bar->atlases = grow_array(bar->atlases, &bar->atlases_cap, bar->num_atlases + 1,
+            sizeof(*bar->atlases));
+    bar->atlases[bar->num_atlases++] = atlas;
+    return atlas;
+}
+
+/* Copy the cells for text into pixels at x, right aligned in cells cells.
+ * Text longer than that is cut off after the first cells characters. */
+static void glyph_atlas_compose(const struct glyph_atlas *atlas, const char *text,
+        int cells, unsigned char *data, int stride, int x) {
+    int bpp = atlas->format == CAIRO_FORMAT_RGB16_565 ? 2 : 4;
+    size_t cell_bytes = (size_t)atlas->cell_width * bpp;
+    int len = strlen(text);
+    int shown = len < cells ? len : cells;
+
+    int glyphs[MAX_ATLAS_CELLS];
+    for (int i = 0; i < cells - shown; i++)
+        glyphs[i] = NUM_ATLAS_GLYPHS - 1;   // Blank
+    for (int i = 0; i < shown; i++)
+        glyphs[cells - shown + i] = atlas_glyph(text[i]);
+
+    unsigned char *dst = data + (size_t)x * bpp;
+    const unsigned char *src = atlas->data;
+    for (int y = 0; y < atlas->height; y++) {
+        for (int i = 0; i < cells; i++)
+            memcpy(dst + i * cell_bytes, src + glyphs[i] * cell_bytes, cell_bytes);
+        dst += stride;
+        src += atlas->stride;
+    }
+}
+
+/* Compose an atlas block's text into the image surface cr draws to. */
+static void draw_atlas_text(cairo_t *cr, const struct frame_block *fb) {
+    cairo_surface_t *target = cairo_get_target(cr);
+    double x = fb->cell.text_x, y = 0;
+    cairo_user_to_device(cr, &x, &y);
+
+    cairo_surface_flush(target);
+    glyph_atlas_compose(fb->atlas, fb->block->text, fb->block->digits,
+            cairo_image_surface_get_data(target), cairo_image_surface_get_stride(target), x);
+    cairo_surface_mark_dirty_rectangle(target, x, 0, fb->width, fb->atlas->height);
+}
+
+/* Scroll position of a strip right now. Headless frames don't scroll, so
+ * dumps stay reproducible. */
+static int marquee_scroll(const struct limebar *bar, const struct marquee_strip *strip) {
+    if (!bar->output->surface)
+        return 0;
+    uint64_t elapsed_ms = (now_ns() - strip->start_ns) / 1000000;
+    return elapsed_ms * MARQUEE_SPEED * bar->scale / SCALE_ONE / 1000 % strip->width;
+}
+
+/* Shape every block and work out where it goes. The flat bar->frame array
+ * of cells is kept from frame to frame; as long as the blocks still fall
+ * into the same segments only widths and positions are refreshed. */
+static void layout_blocks(struct limebar *bar) {
+    bar->animating = false;
+    if (!bar->segments_valid || !segments_match(bar)) {
+        build_segments(bar);
+        bar->segments_valid = true;
+    }
+
+    // Measure every cell
+    for (size_t i = 0; i < bar->num_frame; i++) {
+        struct frame_block *fb = &bar->frame[i];
+
+        if (fb->block_index < 0) {
+            int height;
+            fb->block = NULL;
+            fb->layout = layout_cache_get(&bar->layouts, bar->pango_context, bar->frame_fonts,
+                0, bar->scale, bar->config->separator, &fb->width, &height);
+            fb->cell = (struct drawn_cell){
+                .text_y = text_y_for_height(bar, height),
+                .fg_color = COLOR_WHITE,    // Separator color
+                .is_separator = true,
+            };
+            continue;
+        }
+
+        struct text_block *block = &bar->frame_src[fb->block_index];
+        int font_index = block->font_index < bar->num_fonts ? block->font_index : 0;
+        int height;
+
+        fb->block = block;
+        fb->strip = NULL;
+        fb->atlas = NULL;
+
+        // Numbers come from the glyph atlas, unshaped and fixed width
+        if (block->digits > 0 && atlas_text(block->text)) {
+            fb->atlas = glyph_atlas_get(bar, font_index, block->fg_color,
+                    block->bg_color, bar->background, bar->format);
+            fb->layout = NULL;
+            fb->width = block->digits * fb->atlas->cell_width;
+            fb->cell = (struct drawn_cell){
+                .text_y = text_y_for_height(bar, fb->atlas->text_height),
+                .text = block->text,
+                .text_len = strlen(block->text),
+                .text_hash = hash_bytes(block->text, strlen(block->text), 2166136261u),
+                .font_index = font_index,
+                .fg_color = block->fg_color,
+                .bg_color = block->bg_color,
+                .underline_color = block->underline_color,
+                .underline = block->underline,
+            };
+            continue;
+        }
+
+        fb->layout = layout_cache_get(&bar->layouts, bar->pango_context,
+            bar->frame_fonts, font_index, bar->scale, block->text, &fb->width, &height);
+        fb->cell = (struct drawn_cell){
+            .text_y = text_y_for_height(bar, height),
+            .text = block->text,
+            .text_len = strlen(block->text),
+            .text_hash = hash_bytes(block->text, strlen(block->text), 2166136261u),
+            .font_index = font_index,
+            .fg_color = block->fg_color,
+            .bg_color = block->bg_color,
+            .underline_color = block->underline_color,
+            .underline = block->underline,
+        };
+
+        // Marquee blocks are fixed width and scroll text that doesn't fit
+        if (block->marquee > 0) {
+            int marquee = scale_px(bar->scale, block->marquee);
+            if (fb->width > marquee) {
+                fb->strip = marquee_strip_get(bar, fb, fb->width);
+                fb->cell.scrolling = true;
+                fb->cell.scroll_x = marquee_scroll(bar, fb->strip);
+                bar->animating = true;
+            }
+            fb->width = marquee;
+        }
+    }
+    marquee_strips_expire(bar);
+
+    // Place each segment, then the cells inside it left to right
+    int left = bar->metrics.margin_left;
+    int right = bar->width - bar->metrics.margin_right;
+    for (int seg = 0; seg < NUM_SEGMENTS; seg++) {
+        int total_width = 0;
+        for (size_t i = bar->segments[seg].first; i < bar->segments[seg].end; i++) {
+            const struct frame_block *fb = &bar->frame[i];
+            total_width += fb->width;
+            if (fb->block)
+                total_width += bar->metrics.padding * 2;
+        }
+
+        int x = left;
+        if (seg == SEGMENT_CENTER)
+            x = left + (right - left - total_width) / 2;
+        else if (seg == SEGMENT_RIGHT)
+            x = right - total_width;
+
+        for (size_t i = bar->segments[seg].first; i < bar->segments[seg].end; i++) {
+            struct frame_block *fb = &bar->frame[i];
+            int padding = fb->block ? bar->metrics.padding : 0;
+            fb->cell.x0 = x;
+            fb->cell.text_x = x + padding;
+            fb->cell.x1 = x + fb->width + padding * 2;
+            x = fb->cell.x1;
+        }
+    }
+}
+
+static void draw_block(struct limebar *bar, cairo_t *cr, const struct frame_block *fb) {
+    const struct drawn_cell *cell = &fb->cell;
+
+    // Draw background if specified
+    int bg_height = bar->height - bar->metrics.margin_top - bar->metrics.margin_bottom;
+    if (cell->bg_color >> 24 && !fill_solid(cr, cell->x0, bar->metrics.margin_top,
+                cell->x1 - cell->x0, bg_height, cell->bg_color)) {
+        set_source_color(cr, cell->bg_color);
+        cairo_rectangle(cr, cell->x0, bar->metrics.margin_top, cell->x1 - cell->x0, bg_height);
+        cairo_fill(cr);
+    }
+
+    // Draw text, or the visible window of a scrolling marquee
+    if (fb->atlas) {
+        draw_atlas_text(cr, fb);
+    } else if (fb->strip) {
+        cairo_save(cr);
+        cairo_rectangle(cr, cell->text_x, 0, fb->width, bar->height);
+        cairo_clip(cr);
+        for (int x = cell->text_x - cell->scroll_x; x < cell->text_x + fb->width;
+                x += fb->strip->width) {
+            cairo_set_source_surface(cr, fb->strip->surface, x, 0);
+            cairo_paint(cr);
+        }
+        cairo_restore(cr);
+    } else {
+        set_source_color(cr, cell->fg_color);
+        cairo_move_to(cr, cell->text_x, cell->text_y);
+        pango_cairo_show_layout(cr, fb->layout);
+    }
+
+    // Draw underline; a stroke of even thickness covers whole pixel rows
+    int thickness = bar->metrics.underline_thickness;
+    if (cell->underline && !fill_solid(cr, cell->text_x,
+                bar->height - bar->metrics.margin_bottom - thickness * 1.5,
+                fb->width, thickness, cell->underline_color)) {
+        set_source_color(cr, cell->underline_color);
+        cairo_set_line_width(cr, bar->metrics.underline_thickness);
+        cairo_move_to(cr, cell->text_x,
+            bar->height - bar->metrics.margin_bottom - bar->metrics.underline_thickness);
+        cairo_line_to(cr, cell->text_x + fb->width,
+            bar->height - bar->metrics.margin_bottom - bar->metrics.underline_thickness);
+        cairo_stroke(cr);
+    }
+}
+
+static void block_cache_remove(struct block_cache *cache, size_t index) {
+    struct block_cache_entry *entry = &cache->entries[index];
+    cache->bytes -= entry->bytes;
+    cairo_surface_destroy(entry->surface);
+    free(entry->text);
+    cache->entries[index] = cache->entries[--cache->count];
+}
+
+/* Return a surface holding the rendered cell, rendering and caching it on a
+ * miss, or NULL if the cell does not fit the budget at all. The surface is
+ * only valid until the next lookup. */
+static cairo_surface_t *block_cache_get(struct limebar *bar, const struct frame_block *fb) {
+    struct block_cache *cache = &bar->block_cache;
+    const struct drawn_cell *cell = &fb->cell;
+    const char *text = fb->block->text;
+    size_t len = strlen(text);
+    int width = cell->x1 - cell->x0;
+    int height = bar->height;
+    int text_x = cell->text_x - cell->x0;
+
+    if (width <= 0 || height <= 0)
+        return NULL;
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    size_t bytes = (size_t)stride * height;
+    if (bytes > cache->budget)
+        return NULL;
+
+    cache->tick++;
+    for (size_t i = 0; i < cache->count; i++) {
+        struct block_cache_entry *entry = &cache->entries[i];
+        if (entry->text_hash == cell->text_hash && entry->len == len &&
+                entry->font_index == cell->font_index &&
+                entry->fg_color == cell->fg_color &&
+                entry->bg_color == cell->bg_color &&
+                entry->underline_color == cell->underline_color &&
+                entry->underline == cell->underline &&
+                entry->width == width && entry->height == height &&
+                entry->text_x == text_x && entry->text_y == cell->text_y &&
+                entry->scale == bar->scale &&
+                memcmp(entry->text, text, len) == 0) {
+            entry->last_used = cache->tick;
+            cache->hits++;
+            return entry->surface;
+        }
+    }
+    cache->misses++;
+
+    // Evict least recently used blocks until the new one fits
+    while (cache->count > 0 && cache->bytes + bytes > cache->budget) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < cache->count; i++) {
+            if (cache->entries[i].last_used < cache->entries[oldest].last_used)
+                oldest = i;
+        }
+        block_cache_remove(cache, oldest);
+        cache->evictions++;
+    }
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t *cr = cairo_create(surface);
+    cairo_translate(cr, -cell->x0, 0);
+    draw_block(bar, cr, fb);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+
+    cache->entries = grow_array(cache->entries, &cache->cap, cache->count + 1,
+            sizeof(*cache->entries));
+    cache->entries[cache->count++] = (struct block_cache_entry){
+        .text = strndup(text, len),
+        .len = len,
+        .text_hash = cell->text_hash,
+        .font_index = cell->font_index,
+        .fg_color = cell->fg_color,
+        .bg_color = cell->bg_color,
+        .underline_color = cell->underline_color,
+        .underline = cell->underline,
+        .width = width,
+        .height = height,
+        .text_x = text_x,
+        .text_y = cell->text_y,
+        .scale = bar->scale,
+        .surface = surface,
+        .bytes = bytes,
+        .last_used = cache->tick,
+    };
+    cache->bytes += bytes;
+    return surface;
+}
+
+static void block_cache_finish(struct block_cache *cache) {
+    while (cache->count > 0)
+        block_cache_remove(cache, cache->count - 1);
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->cap = 0;
+}
+
+/* Blocks with the S attribute get a wl_subsurface of their own, stacked
+ * above the bar in desynchronized mode. Updating such a block commits only
+ * its small buffer; the bar surface just shows its background there. */
+#define BLOCK_SURFACE_BUFFERS 2
+
+struct block_surface;
+
+struct block_surface_buffer {
+    struct wl_buffer *buffer;
+    cairo_surface_t *cairo_surface;
+    size_t offset;              // Where the view starts in the pool
+    size_t size;
+    bool busy;
+    struct block_surface *owner;
+};
+
+struct block_surface {
+    char *key;                  // Block id, or "#N" for the Nth unnamed one
+    struct wl_surface *surface;
+    struct wl_subsurface *subsurface;
+    int fd;
+    void *data;
+    size_t size;                // Mapped bytes, only ever grows
+    struct wl_shm_pool *pool;
+    struct block_surface_buffer buffers[BLOCK_SURFACE_BUFFERS];
+    struct retired_buffer *retired;     // Old views not yet released
+    size_t num_retired;
+    size_t retired_cap;
+    int width;
+    int height;
+    int x;                      // Position set on the subsurface
+    bool placed;
+    bool drawn;                 // cell holds what is shown
+    struct drawn_cell cell;     // Relative to the block's left edge
+    char *text;                 // The cell's text
+    unsigned long frame;        // Layout frame that last used it
+    struct bar_output *output;
+};
+
+static void block_surface_buffer_release(void *data, struct wl_buffer *wl_buffer) {
+    struct block_surface_buffer *buf = data;
+    struct block_surface *bs = buf->owner;
+    struct bar_output *output = bs->output;
+
+    // A view from before a resize that used this slot; its range is free now
+    if (wl_buffer != buf->buffer) {
+        for (size_t i = 0; i < bs->num_retired; i++) {
+            if (bs->retired[i].buffer != wl_buffer)
+                continue;
+            wl_buffer_destroy(wl_buffer);
+            bs->retired[i] = bs->retired[--bs->num_retired];
+            break;
+        }
+        return;
+    }
+
+    buf->busy = false;
+    if (output->dirty && !output->frame_callback)
+        render_frame(output->bar);
+}
+
+static const struct wl_buffer_listener block_surface_buffer_listener = {
+    .release = block_surface_buffer_release,
+};
+
+/* Drop the buffer views. The one the subsurface shows is always held, so
+ * like the bar's, held views are retired until the compositor lets go. */
+static void block_surface_destroy_buffers(struct block_surface *bs) {
+    for (int i = 0; i < BLOCK_SURFACE_BUFFERS; i++) {
+        struct block_surface_buffer *buf = &bs->buffers[i];
+        if (buf->buffer && buf->busy) {
+            bs->retired = grow_array(bs->retired, &bs->retired_cap,
+                    bs->num_retired + 1, sizeof(*bs->retired));
+            bs->retired[bs->num_retired++] = (struct retired_buffer){
+                .buffer = buf->buffer,
+                .offset = buf->offset,
+                .size = buf->size,
+            };
+        } else if (buf->buffer) {
+            wl_buffer_destroy(buf->buffer);
+        }
+        if (buf->cairo_surface)
+            cairo_surface_destroy(buf->cairo_surface);
+        memset(buf, 0, sizeof(*buf));
+    }
+}
+
+/* (Re)create the buffers for a new block size, past any the compositor
+ * still holds, growing the pool when they do not fit. */
+static void block_surface_resize(struct block_surface *bs, int width, int height) {
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    size_t buffer_size = (size_t)stride * height;
+
+    block_surface_destroy_buffers(bs);
+    size_t base = 0;
+    for (size_t i = 0; i < bs->num_retired; i++) {
+        size_t end = bs->retired[i].offset + bs->retired[i].size;
+        if (end > base)
+            base = end;
+    }
+    size_t size = base + buffer_size * BLOCK_SURFACE_BUFFERS;
+    if (size > bs->size) {
+        if (ftruncate(bs->fd, size) == -1) {
+            fprintf(stderr, "Failed to set file size: %s\n", strerror(errno));
+            exit(1);
+        }
+        void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Failed to mmap: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (bs->data)
+            munmap(bs->data, bs->size);
+        bs->data = data;
+        bs->size = size;
+        if (bs->pool)
+            wl_shm_pool_resize(bs->pool, size);
+        else
+            bs->pool = wl_shm_create_pool(bs->output->bar->shm, bs->fd, size);
+    }
+
+    for (int i = 0; i < BLOCK_SURFACE_BUFFERS; i++) {
+        struct block_surface_buffer *buf = &bs->buffers[i];
+        buf->owner = bs;
+        buf->offset = base + buffer_size * i;
+        buf->size = buffer_size;
+        buf->buffer = wl_shm_pool_create_buffer(bs->pool, buf->offset,
+                width, height, stride, WL_SHM_FORMAT_ARGB8888);
+        wl_buffer_add_listener(buf->buffer, &block_surface_buffer_listener, buf);
+        buf->cairo_surface = cairo_image_surface_create_for_data(
+                (unsigned char *)bs->data + buf->offset,
+                CAIRO_FORMAT_ARGB32, width, height, stride);
+    }
+    bs->width = width;
+    bs->height = height;
+    bs->drawn = false;
+}
+
+static struct block_surface *block_surface_get(struct limebar *bar,
+        struct bar_output *output, const char *key) {
+    for (size_t i = 0; i < output->num_block_surfaces; i++) {
+        if (strcmp(output->block_surfaces[i]->key, key) == 0)
+            return output->block_surfaces[i];
+    }
+
+    struct block_surface *bs = calloc(1, sizeof(*bs));
+    bs->key = strdup(key);
+    bs->output = output;
+    bs->fd = memfd_create("limebar-block", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (bs->fd < 0) {
+        fprintf(stderr, "Failed to create memfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    fcntl(bs->fd, F_ADD_SEALS, F_SEAL_SHRINK);
+
+    bs->surface = wl_compositor_create_surface(bar->compositor);
+    bs->subsurface = wl_subcompositor_get_subsurface(bar->subcompositor,
+            bs->surface, output->surface);
+    wl_subsurface_set_desync(bs->subsurface);
+    wl_subsurface_place_above(bs->subsurface, output->surface);
+
+    // Input goes to the bar below
+    struct wl_region *region = wl_compositor_create_region(bar->compositor);
+    wl_surface_set_input_region(bs->surface, region);
+    wl_region_destroy(region);
+
+    output->block_surfaces = grow_array(output->block_surfaces, &output->block_surfaces_cap,
+            output->num_block_surfaces + 1, sizeof(*output->block_surfaces));
+    output->block_surfaces[output->num_block_surfaces++] = bs;
+    return bs;
+}
+
+static void block_surface_free(struct block_surface *bs) {
+    block_surface_destroy_buffers(bs);
+    for (size_t i = 0; i < bs->num_retired; i++)
+        wl_buffer_destroy(bs->retired[i].buffer);
+    free(bs->retired);
+    free(bs->text);
+    if (bs->pool)
+        wl_shm_pool_destroy(bs->pool);
+    if (bs->data)
+        munmap(bs->data, bs->size);
+    close(bs->fd);
+    wl_subsurface_destroy(bs->subsurface);
+    wl_surface_destroy(bs->surface);
+    free(bs->key);
+    free(bs);
+}
+
+/* Render a block into its subsurface and commit it there. Returns false if
+ * both of its buffers are still held by the compositor. */
+static bool block_surface_draw(struct limebar *bar, struct block_surface *bs,
+        const struct frame_block *fb) {
+    struct block_surface_buffer *buf = NULL;
+    for (int i = 0; i < BLOCK_SURFACE_BUFFERS; i++) {
+        if (!bs->buffers[i].busy) {
+            buf = &bs->buffers[i];
+            break;
+        }
+    }
+    if (!buf)
+        return false;
+
+    cairo_t *cr = cairo_create(buf->cairo_surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    cairo_translate(cr, -fb->cell.x0, 0);
+    cairo_surface_t *rendered = fb->strip || fb->atlas ? NULL : block_cache_get(bar, fb);
+    if (rendered) {
+        cairo_set_source_surface(cr, rendered, fb->cell.x0, 0);
+        cairo_paint(cr);
+    } else {
+        draw_block(bar, cr, fb);
+    }
+    cairo_destroy(cr);
+    cairo_surface_flush(buf->cairo_surface);
+
+    wl_surface_attach(bs->surface, buf->buffer, 0, 0);
+    wl_surface_damage_buffer(bs->surface, 0, 0, bs->width, bs->height);
+
+    // Pace further updates on this surface too
+    struct bar_output *output = bs->output;
+    if (!output->frame_callback) {
+        output->frame_callback = wl_surface_frame(bs->surface);
+        wl_callback_add_listener(output->frame_callback, &frame_listener, output);
+    }
+    wl_surface_commit(bs->surface);
+    buf->busy = true;
+    return true;
+}
+
+/* Move S blocks onto their subsurfaces. What is left of them in the frame
+ * is their extent, so the bar only repaints, and commits the new subsurface
+ * position along with it, when one moves or resizes. */
+static void update_block_surfaces(struct limebar *bar) {
+    struct bar_output *output = bar->output;
+    int unnamed = 0;
+
+    for (size_t i = 0; i < bar->num_frame; i++) {
+        struct frame_block *fb = &bar->frame[i];
+        if (!fb->block || !fb->block->subsurface)
+            continue;
+
+        char key[32];
+        const char *id = fb->block->id;
+        if (!id) {
+            snprintf(key, sizeof(key), "#%d", unnamed++);
+            id = key;
+        }
+        struct block_surface *bs = block_surface_get(bar, output, id);
+        bs->frame = bar->layouts.frame;
+
+        struct drawn_cell cell = fb->cell;
+        int width = cell.x1 - cell.x0;
+        cell.text_x -= cell.x0;
+        cell.x1 -= cell.x0;
+        cell.x0 = 0;
+
+        if (width > 0) {
+            if (width != bs->width || bar->height != (uint32_t)bs->height)
+                block_surface_resize(bs, width, bar->height);
+            if (!bs->drawn || !cells_equal(&bs->cell, &cell)) {
+                // Subsurface cells go over nothing, in ARGB
+                struct frame_block sub = *fb;
+                if (fb->atlas)
+                    sub.atlas = glyph_atlas_get(bar, cell.font_index, cell.fg_color,
+                            cell.bg_color, 0, CAIRO_FORMAT_ARGB32);
+                if (block_surface_draw(bar, bs, &sub)) {
+                    free(bs->text);
+                    bs->text = strndup(cell.text ? cell.text : "", cell.text_len);
+                    bs->cell = cell;
+                    bs->cell.text = bs->text;
+                    bs->drawn = true;
+                } else {
+                    output->dirty = true;   // Retried once a buffer is released
+                }
+            }
+        }
+        if (!bs->placed || bs->x != fb->cell.x0) {
+            wl_subsurface_set_position(bs->subsurface, fb->cell.x0, 0);
+            bs->x = fb->cell.x0;
+            bs->placed = true;
+        }
+
+        fb->cell = (struct drawn_cell){
+            .x0 = fb->cell.x0,
+            .x1 = fb->cell.x1,
+            .in_subsurface = true,
+        };
+    }
+
+    // Drop the subsurfaces of blocks that are gone
+    for (size_t i = 0; i < output->num_block_surfaces; ) {
+        if (output->block_surfaces[i]->frame == bar->layouts.frame) {
+            i++;
+            continue;
+        }
+        block_surface_free(output->block_surfaces[i]);
+        output->block_surfaces[i] = output->block_surfaces[--output->num_block_surfaces];
+    }
+}
+
+static void headless_present(struct limebar *bar, struct pool_buffer *buf);
+
+static void draw_separator(cairo_t *cr, const struct frame_block *fb) {
+    set_source_color(cr, fb->cell.fg_color);
+    cairo_move_to(cr, fb->cell.text_x, fb->cell.text_y);
+    pango_cairo_show_layout(cr, fb->layout);
+}
+
+/* Return the buffer another output of the same size and scale last
+ * committed if it holds exactly the frame laid out for this one, or NULL. */
+static struct pool_buffer *find_twin_buffer(struct limebar *bar) {
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        struct pool_buffer *twin = bar->outputs[i]->last_buffer;
+        if (bar->outputs[i] == bar->output || bar->outputs[i]->scale != bar->scale ||
+                !twin || !twin->valid ||
+                twin->width != bar->width || twin->height != bar->height ||
+                twin->num_cells != bar->num_frame)
+            continue;
+
+        size_t n = 0;
+        while (n < bar->num_frame && cells_equal(&twin->cells[n], &bar->frame[n].cell))
+            n++;
+        if (n == bar->num_frame)
+            return twin;
+    }
+    return NULL;
+}
+
+/* Copy the repainted spans over from a buffer of the same size. */
+static void copy_spans(struct limebar *bar, struct pool_buffer *buf,
+        const struct pool_buffer *twin) {
+    int stride = cairo_image_surface_get_stride(buf->cairo_surface);
+    int bpp = bar->format == CAIRO_FORMAT_RGB16_565 ? 2 : 4;
+
+    cairo_surface_flush(buf->cairo_surface);
+    for (size_t i = 0; i < bar->repaint.count; i++) {
+        const struct damage_span *span = &bar->repaint.spans[i];
+        size_t offset = (size_t)span->x0 * bpp;
+        size_t len = (size_t)(span->x1 - span->x0) * bpp;
+        for (uint32_t y = 0; y < buf->height; y++) {
+            memcpy((char *)buf->data + offset + (size_t)y * stride,
+                    (const char *)twin->data + offset + (size_t)y * stride, len);
+        }
+    }
+    cairo_surface_mark_dirty(buf->cairo_surface);
+}
+
+/* Paint the background and the cells over the repainted spans. */
+static void paint_spans(struct limebar *bar, cairo_t *cr) {
+    // Everything below only touches the repainted spans
+    cairo_save(cr);
+    for (size_t i = 0; i < bar->repaint.count; i++) {
+        const struct damage_span *span = &bar->repaint.spans[i];
+        cairo_rectangle(cr, span->x0, 0, span->x1 - span->x0, bar->height);
+    }
+    cairo_clip(cr);
+
+    // Clear with background color and opacity
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    bool cleared = false;
+    for (size_t i = 0; i < bar->repaint.count; i++) {
+        const struct damage_span *span = &bar->repaint.spans[i];
+        cleared = fill_solid(cr, span->x0, 0, span->x1 - span->x0, bar->height,
+                bar->background);
+        if (!cleared)
+            break;
+    }
+    if (!cleared) {
+        set_source_color(cr, bar->background);
+        cairo_paint(cr);
+    }
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+    for (size_t i = 0; i < bar->num_frame; i++) {
+        const struct frame_block *fb = &bar->frame[i];
+        if (!damage_intersects(&bar->repaint, fb->cell.x0, fb->cell.x1))
+            continue;
+
+        if (fb->cell.is_separator) {
+            draw_separator(cr, fb);
+            continue;
+        }
+        if (fb->cell.in_subsurface)
+            continue;
+
+        // Blit a previously rendered copy when there is one; scrolling
+        // blocks change every frame and are not worth caching, and atlas
+        // blocks are composed faster than they are looked up
+        cairo_surface_t *rendered = fb->strip || fb->atlas ? NULL : block_cache_get(bar, fb);
+        if (rendered) {
+            cairo_set_source_surface(cr, rendered, fb->cell.x0, 0);
+            cairo_paint(cr);
+        } else {
+            draw_block(bar, cr, fb);
+        }
+    }
+    cairo_restore(cr);
+}
+
+/* Lay out the frame_src blocks and paint what changed into buf, leaving the
+ * spans that differ from the screen in bar->surface_damage. Returns false,
+ * with buf untouched, if the screen would stay the same. Layout and raster
+ * times go to stage_ns. With --render-thread this runs on the worker. */
+static bool render_blocks(struct limebar *bar, struct pool_buffer *buf, uint64_t *stage_ns) {
+    struct bar_output *output = bar->output;
+    cairo_t *cr = buf->cairo;
+
+    if (!bar->pango_context)
+        bar->pango_context = pango_cairo_create_context(cr);
+    bar->layouts.frame++;
+
+    uint64_t start = now_ns();
+    layout_blocks(bar);
+    // Subsurfaces are placed in logical pixels, which only match device
+    // pixels at scale one
+    if (bar->subcompositor && output->surface && !bar->render.running &&
+            bar->scale == SCALE_ONE)
+        update_block_surfaces(bar);
+
+    // Damage against what the compositor shows decides whether there is
+    // anything to commit; damage against what this buffer holds decides
+    // what has to be repainted into it.
+    bar->surface_damage.count = 0;
+    if (output->last_buffer) {
+        damage_diff(&bar->surface_damage, bar->frame, bar->num_frame,
+                output->last_buffer->cells, output->last_buffer->num_cells);
+    } else {
+        damage_add(&bar->surface_damage, 0, bar->width);
+    }
+    damage_normalize(&bar->surface_damage, bar->width);
+
+    // Nothing on screen would change
+    if (bar->surface_damage.count == 0) {
+        stage_ns[STAGE_LAYOUT] = now_ns() - start;
+        return false;
+    }
+
+    bar->repaint.count = 0;
+    if (buf->valid) {
+        damage_diff(&bar->repaint, bar->frame, bar->num_frame,
+                buf->cells, buf->num_cells);
+    } else {
+        damage_add(&bar->repaint, 0, bar->width);
+    }
+    damage_normalize(&bar->repaint, bar->width);
+    stage_ns[STAGE_LAYOUT] = now_ns() - start;
+    start = now_ns();
+
+    // An output of the same size may already show this very frame
+    struct pool_buffer *twin = find_twin_buffer(bar);
+    if (twin) {
+        copy_spans(bar, buf, twin);
+        bar->stats.frames_shared++;
+    } else {
+        paint_spans(bar, cr);
+    }
+
+    // Remember what this buffer now holds, with a copy of the text since
+    // the blocks it came from go with the next line
+    buf->cells = grow_array(buf->cells, &buf->cells_cap, bar->num_frame,
+            sizeof(*buf->cells));
+    size_t text_size = 0;
+    for (size_t i = 0; i < bar->num_frame; i++)
+        text_size += ARENA_ALIGN(bar->frame[i].cell.text_len);
+    arena_reset(&buf->cell_text, text_size);
+    for (size_t i = 0; i < bar->num_frame; i++) {
+        struct drawn_cell *cell = &buf->cells[i];
+        *cell = bar->frame[i].cell;
+        if (cell->text_len > 0) {
+            char *text = arena_alloc(&buf->cell_text, cell->text_len);
+            memcpy(text, cell->text, cell->text_len);
+            cell->text = text;
+        }
+    }
+    buf->num_cells = bar->num_frame;
+    buf->valid = true;
+    output->last_buffer = buf;
+    stage_ns[STAGE_RASTER] = now_ns() - start;
+    return true;
+}
+
+/* Show a rendered frame on bar->output: commit buf, damaging
+ * bar->surface_damage, or with a NULL buf, when nothing changed, just keep a
+ * scrolling marquee's frame callbacks coming. Always runs on the main
+ * thread. */
+static void present_frame(struct limebar *bar, struct pool_buffer *buf,
+        const uint64_t *stage_ns) {
+    struct bar_output *output = bar->output;
+    stats_record(&bar->stats, STAGE_LAYOUT, stage_ns[STAGE_LAYOUT]);
+    if (!buf) {
+        bar->stats.frames_unchanged++;
+        TRACE(TRACE_FRAME, "frame unchanged, nothing to commit\n");
+
+        // A marquee that hasn't moved a whole pixel yet still needs the
+        // next frame callback
+        if (bar->animating && output->surface && !output->frame_callback) {
+            output->frame_callback = wl_surface_frame(output->surface);
+            wl_callback_add_listener(output->frame_callback, &frame_listener, output);
+            wl_surface_commit(output->surface);
+        }
+        return;
+    }
+    stats_record(&bar->stats, STAGE_RASTER, stage_ns[STAGE_RASTER]);
+    uint64_t start = now_ns();
+    uint64_t damaged = 0;
+    for (size_t i = 0; i < bar->surface_damage.count; i++) {
+        const struct damage_span *span = &bar->surface_damage.spans[i];
+        damaged += (uint64_t)(span->x1 - span->x0) * bar->height;
+    }
+    damaged *= bar->format == CAIRO_FORMAT_RGB16_565 ? 2 : 4;
+    bar->stats.bytes_damaged += damaged;
+    bar->stats.frames_drawn++;
+    TRACE(TRACE_FRAME, "frame %lu: %zu cells, %zu repainted spans, %llu bytes damaged\n",
+            bar->stats.frames_drawn, bar->num_frame, bar->repaint.count,
+            (unsigned long long)damaged);
+
+    if (!output->surface) {
+        headless_present(bar, buf);
+        stats_stage(&bar->stats, STAGE_COMMIT, start);
+        return;
+    }
+
+    // Commit the surface
+    wl_surface_attach(output->surface, buf->buffer, 0, 0);
+    for (size_t i = 0; i < bar->surface_damage.count; i++) {
+        const struct damage_span *span = &bar->surface_damage.spans[i];
+        wl_surface_damage_buffer(output->surface, span->x0, 0,
+                span->x1 - span->x0, bar->height);
+    }
+    if (!output->frame_callback) {
+        output->frame_callback = wl_surface_frame(output->surface);
+        wl_callback_add_listener(output->frame_callback, &frame_listener, output);
+    }
+    wl_surface_commit(output->surface);
+    buf->busy = true;
+    stats_stage(&bar->stats, STAGE_COMMIT, start);
+}
+
+static void render_thread_post(struct limebar *bar);
+static void render_thread_grant(struct limebar *bar, struct pool_buffer *buf);
+
+/* Return the fonts sized for scale, copying them on first use. */
+static PangoFontDescription **fonts_for_scale(struct limebar *bar, int scale) {
+    if (scale == SCALE_ONE)
+        return bar->font_descs;
+    for (size_t i = 0; i < bar->num_scaled_fonts; i++) {
+        if (bar->scaled_fonts[i].scale == scale)
+            return bar->scaled_fonts[i].descs;
+    }
+
+    PangoFontDescription **descs = malloc(sizeof(*descs) * bar->num_fonts);
+    for (int i = 0; i < bar->num_fonts; i++) {
+        descs[i] = pango_font_description_copy(bar->font_descs[i]);
+        int size = pango_font_description_get_size(descs[i]);
+        if (pango_font_description_get_size_is_absolute(descs[i]))
+            pango_font_description_set_absolute_size(descs[i], (double)size * scale / SCALE_ONE);
+        else
+            pango_font_description_set_size(descs[i], (int64_t)size * scale / SCALE_ONE);
+    }
+
+    bar->scaled_fonts = grow_array(bar->scaled_fonts, &bar->scaled_fonts_cap,
+            bar->num_scaled_fonts + 1, sizeof(*bar->scaled_fonts));
+    bar->scaled_fonts[bar->num_scaled_fonts++] = (struct scaled_fonts){scale, descs};
+    return descs;
+}
+
+/* Make output the one frames are laid out for: its device size, and fonts
+ * and command line sizes at its scale. */
+static void use_output(struct limebar *bar, struct bar_output *output,
+        const struct pool_buffer *buf) {
+    const struct bar_config *config = bar->config;
+    int scale = output->scale;
+
+    bar->output = output;
+    bar->width = buf->width;
+    bar->height = buf->height;
+    bar->scale = scale;
+    bar->frame_fonts = fonts_for_scale(bar, scale);
+    bar->metrics = (struct bar_metrics){
+        .padding = scale_px(scale, config->padding),
+        .margin_top = scale_px(scale, config->margin_top),
+        .margin_bottom = scale_px(scale, config->margin_bottom),
+        .margin_left = scale_px(scale, config->margin_left),
+        .margin_right = scale_px(scale, config->margin_right),
+        .underline_thickness = scale_px(scale, config->underline_thickness),
+        .marquee_gap = scale_px(scale, MARQUEE_GAP),
+    };
+}
+
+static void draw(struct limebar *bar, struct bar_output *output) {
+    // The render thread works on one frame at a time
+    if (bar->render.running && bar->render.granted) {
+        output->dirty = true;
+        return;
+    }
+
+    // Never paint into a buffer the compositor may still be reading.
+    // The output stays dirty and is redrawn when a buffer is released.
+    struct pool_buffer *buf = get_free_buffer(output);
+    if (!buf) {
+        output->dirty = true;
+        return;
+    }
+    output->dirty = false;
+    output->last_frame_ns = now_ns();
+    use_output(bar, output, buf);
+
+    if (bar->render.running) {
+        render_thread_grant(bar, buf);
+        return;
+    }
+
+    uint64_t stage_ns[NUM_STAGES] = {0};
+    bar->frame_src = bar->blocks;
+    bar->num_frame_src = bar->num_blocks;
+    bool changed = render_blocks(bar, buf, stage_ns);
+    present_frame(bar, changed ? buf : NULL, stage_ns);
+}
+
+/* Milliseconds until --max-fps allows the next frame on output, 0 if it may
+ * be drawn right away. */
+static int frame_delay_ms(struct limebar *bar, struct bar_output *output) {
+    if (!bar->min_frame_ns)
+        return 0;
+
+    uint64_t elapsed = now_ns() - output->last_frame_ns;
+    if (elapsed >= bar->min_frame_ns)
+        return 0;
+    return (bar->min_frame_ns - elapsed + 999999) / 1000000;
+}
+
+/* Draw the pending blocks on every output the compositor has asked for a
+ * frame and the fps cap doesn't hold back; the others stay dirty and their
+ * frame callback or the main loop timeout picks them up later. */
+static void render_frame(struct limebar *bar) {
+    // The worker gets new blocks as soon as they are parsed; if it is
+    // still busy, only the newest of them is drawn next
+    if (bar->render.running && bar->blocks_changed)
+        render_thread_post(bar);
+
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        struct bar_output *output = bar->outputs[i];
+        if (!output->dirty || output->frame_callback)
+            continue;
+        if (frame_delay_ms(bar, output) > 0)
+            continue;
+        draw(bar, output);
+    }
+}
+
+/* The blocks changed; every output has to show them. */
+static void mark_dirty(struct limebar *bar) {
+    for (size_t i = 0; i < bar->num_outputs; i++)
+        bar->outputs[i]->dirty = true;
+}
+
+/* Whether some output has yet to show the current blocks. */
+static bool any_dirty(const struct limebar *bar) {
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        if (bar->outputs[i]->dirty)
+            return true;
+    }
+    return false;
+}
+
+static bool spsc_push(struct spsc_queue *queue, void *item) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == SPSC_QUEUE_SIZE)
+        return false;
+    queue->slots[tail % SPSC_QUEUE_SIZE] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static void *spsc_pop(struct spsc_queue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    void *item = queue->slots[head % SPSC_QUEUE_SIZE];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
+
+static void eventfd_signal(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Failed to signal eventfd: %s\n", strerror(errno));
+}
+
+/* Forget every shaped layout, rendered block and font, and what the buffers
+ * hold, so the next frame is built from scratch with fresh fontconfig
+ * state. The default font map is per thread, so this runs on whichever
+ * thread renders. */
+static void reset_render_state(struct limebar *bar) {
+    unsigned long hits = bar->layouts.hits, misses = bar->layouts.misses;
+    layout_cache_finish(&bar->layouts);
+    bar->layouts.hits = hits;
+    bar->layouts.misses = misses;
+    block_cache_finish(&bar->block_cache);
+    for (size_t i = 0; i < bar->num_strips; i++)
+        marquee_strip_free(bar->strips[i]);
+    bar->num_strips = 0;
+    for (size_t i = 0; i < bar->num_atlases; i++)
+        glyph_atlas_free(bar->atlases[i]);
+    bar->num_atlases = 0;
+
+    if (bar->pango_context) {
+        g_object_unref(bar->pango_context);
+        bar->pango_context = NULL;
+    }
+    pango_cairo_font_map_set_default(NULL);
+
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        struct bar_output *output = bar->outputs[i];
+        for (int j = 0; j < NUM_BUFFERS; j++)
+            output->buffers[j].valid = false;
+        for (size_t j = 0; j < output->num_block_surfaces; j++)
+            output->block_surfaces[j]->drawn = false;
+        output->last_buffer = NULL;
+    }
+}
+
+/* The worker: keep only the newest job, and whenever a buffer is granted,
+ * draw that job into it. A job replaced before a buffer came along is
+ * never laid out at all. */
+static void *render_thread_main(void *data) {
+    struct limebar *bar = data;
+    struct render_thread *render = &bar->render;
+    struct render_job *pending = NULL;  // Newest job, not drawn yet
+    struct render_job *current = NULL;  // Job on screen, redrawn for marquees
+
+    while (!atomic_load(&render->stop)) {
+        uint64_t count;
+        if (read(render->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+
+        bool retired = false;
+        struct render_job *job;
+        while ((job = spsc_pop(&render->jobs))) {
+            if (pending) {
+                spsc_push(&render->retired, pending);
+                retired = true;
+            }
+            pending = job;
+        }
+
+        struct pool_buffer *buf = spsc_pop(&render->grants);
+        if (buf) {
+            if (pending) {
+                if (current) {
+                    spsc_push(&render->retired, current);
+                    retired = true;
+                }
+                current = pending;
+                pending = NULL;
+            }
+            if (atomic_exchange(&render->reload, false))
+                reset_render_state(bar);
+
+            struct render_result *result = &render->result;
+            memset(result, 0, sizeof(*result));
+            if (current) {
+                bar->frame_src = current->blocks;
+                bar->num_frame_src = current->num_blocks;
+                result->changed = render_blocks(bar, buf, result->stage_ns);
+            }
+            spsc_push(&render->done, result);
+        }
+        if (buf || retired)
+            eventfd_signal(render->done_fd);
+    }
+    return NULL;
+}
+
+static bool render_thread_start(struct limebar *bar) {
+    struct render_thread *render = &bar->render;
+    render->wake_fd = eventfd(0, EFD_CLOEXEC);
+    render->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (render->wake_fd < 0 || render->done_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < RENDER_JOBS; i++)
+        render->free_jobs[i] = &render->job_storage[i];
+    render->num_free_jobs = RENDER_JOBS;
+
+    int err = pthread_create(&render->thread, NULL, render_thread_main, bar);
+    if (err) {
+        fprintf(stderr, "Failed to start render thread: %s\n", strerror(err));
+        return false;
+    }
+    render->running = true;
+    return true;
+}
+
+static void render_thread_stop(struct limebar *bar) {
+    struct render_thread *render = &bar->render;
+    if (render->running) {
+        atomic_store(&render->stop, true);
+        eventfd_signal(render->wake_fd);
+        pthread_join(render->thread, NULL);
+        render->running = false;
+    }
+    if (render->wake_fd >= 0)
+        close(render->wake_fd);
+    if (render->done_fd >= 0)
+        close(render->done_fd);
+    for (int i = 0; i < RENDER_JOBS; i++)
+        free(render->job_storage[i].arena.data);
+}
+
+/* Take back the jobs the worker is done with and show the frame it drew,
+ * if it finished one. */
+static void render_thread_collect(struct limebar *bar) {
+    struct render_thread *render = &bar->render;
+    uint64_t count;
+    if (read(render->done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Failed to read eventfd: %s\n", strerror(errno));
+
+    // Jobs dropped unseen were counted as coalesced when their line was
+    // replaced while the bar was still dirty
+    struct render_job *job;
+    while ((job = spsc_pop(&render->retired)))
+        render->free_jobs[render->num_free_jobs++] = job;
+
+    struct render_result *result = spsc_pop(&render->done);
+    if (result) {
+        struct pool_buffer *buf = render->granted;
+        render->granted = NULL;
+        present_frame(bar, result->changed ? buf : NULL, result->stage_ns);
+
+        // Outputs that wanted a frame meanwhile had to wait for this one
+        render_frame(bar);
+    }
+}
+
+/* Wait for the frame out with the worker, if any, and show it, so the main
+ * thread may touch the render state. */
+static void render_thread_idle(struct limebar *bar) {
+    struct render_thread *render = &bar->render;
+    while (render->running && render->granted) {
+        struct pollfd pfd = {.fd = render->done_fd, .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        render_thread_collect(bar);
+    }
+}
+
+/* Hand a copy of the shown blocks to the worker. If every job is still in
+ * flight the blocks stay changed and go out with a later call. */
+static void render_thread_post(struct limebar *bar) {
+    struct render_thread *render = &bar->render;
+    if (render->num_free_jobs == 0)
+        return;
+
+    struct render_job *job = render->free_jobs[--render->num_free_jobs];
+    size_t size = ARENA_ALIGN(bar->num_blocks * sizeof(struct text_block));
+    for (size_t i = 0; i < bar->num_blocks; i++)
+        size += ARENA_ALIGN(strlen(bar->blocks[i].text) + 1);
+    arena_reset(&job->arena, size);
+
+    job->blocks = NULL;
+    if (bar->num_blocks > 0)
+        job->blocks = arena_alloc(&job->arena, bar->num_blocks * sizeof(struct text_block));
+    for (size_t i = 0; i < bar->num_blocks; i++) {
+        size_t len = strlen(bar->blocks[i].text) + 1;
+        job->blocks[i] = bar->blocks[i];
+        job->blocks[i].text = memcpy(arena_alloc(&job->arena, len), bar->blocks[i].text, len);
+        job->blocks[i].id = NULL;   // Only subsurfaces need ids, and they stay inline
+    }
+    job->num_blocks = bar->num_blocks;
+
+    spsc_push(&render->jobs, job);
+    eventfd_signal(render->wake_fd);
+    bar->blocks_changed = false;
+}
+
+/* Let the worker draw the newest blocks into buf. */
+static void render_thread_grant(struct limebar *bar, struct pool_buffer *buf) {
+    struct render_thread *render = &bar->render;
+    if (bar->blocks_changed)
+        render_thread_post(bar);
+    if (bar->blocks_changed)
+        bar->output->dirty = true;
+
+    render->granted = buf;
+    spsc_push(&render->grants, buf);
+    eventfd_signal(render->wake_fd);
+}
+
+/* Size the buffers for the output's logical size and scale, and tell the
+ * compositor how they map onto the surface: through the viewport when there
+ * is one, which takes any scale, or else as an integer buffer scale. */
+static void output_resize(struct bar_output *output) {
+    struct limebar *bar = output->bar;
+
+    // Buffers are views into the pool; only a new size needs new views
+    struct pool_buffer *first = &output->buffers[0];
+    if (!first->created || first->width != (uint32_t)scale_px(output->scale, output->width) ||
+            first->height != (uint32_t)scale_px(output->scale, output->height)) {
+        destroy_buffers(output);
+        create_buffers(output);
+
+        // Let the compositor skip whatever is below an opaque bar
+        if (bar->opaque) {
+            struct wl_region *region = wl_compositor_create_region(bar->compositor);
+            wl_region_add(region, 0, 0, output->width, output->height);
+            wl_surface_set_opaque_region(output->surface, region);
+            wl_region_destroy(region);
+        } else {
+            wl_surface_set_opaque_region(output->surface, NULL);
+        }
+    }
+
+    if (output->viewport)
+        wp_viewport_set_destination(output->viewport, output->width, output->height);
+    else
+        wl_surface_set_buffer_scale(output->surface, output->scale / SCALE_ONE);
+}
+
+static void layer_surface_configure(void *data,
+        struct zwlr_layer_surface_v1 *surface,
+        uint32_t serial, uint32_t width, uint32_t height) {
+    struct bar_output *output = data;
+    struct limebar *bar = output->bar;
+
+    // The buffers are about to change under the worker
+    render_thread_idle(bar);
+
+    // Only update dimensions if they changed
+    if (width > 0) output->width = width;
+    if (height > 0) output->height = height;
+
+    zwlr_layer_surface_v1_ack_configure(surface, serial);
+    output_resize(output);
+
+    // The ack needs a commit to take effect, so damage the whole surface
+    output->last_buffer = NULL;
+    draw(bar, output);
+}
+
+static void output_destroy_surface(struct bar_output *output);
+
+static void layer_surface_closed(void *data,
+        struct zwlr_layer_surface_v1 *surface) {
+    struct bar_output *output = data;
+    (void)surface;
+
+    // The compositor took the bar off this output for good
+    render_thread_idle(output->bar);
+    output_destroy_surface(output);
+}
+
+static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
+    .configure = layer_surface_configure,
+    .closed = layer_surface_closed,
+};
+
+/* Work out the scale to draw the output at. When it changed on a bar that
+ * is already up, the bar is redrawn at the new size right away; the layer
+ * surface stays as it is. */
+static void output_update_scale(struct bar_output *output) {
+    struct limebar *bar = output->bar;
+
+    int scale = output->output_scale * SCALE_ONE;
+    if (output->viewport && output->preferred_scale)
+        scale = output->preferred_scale;
+    if (scale <= 0)
+        scale = SCALE_ONE;
+    if (scale == output->scale)
+        return;
+    output->scale = scale;
+    if (!output->buffers[0].created)
+        return;
+
+    render_thread_idle(bar);
+
+    // Block subsurfaces only exist at scale one
+    for (size_t i = 0; i < output->num_block_surfaces; i++)
+        block_surface_free(output->block_surfaces[i]);
+    output->num_block_surfaces = 0;
+
+    output_resize(output);
+    for (int i = 0; i < NUM_BUFFERS; i++)
+        output->buffers[i].valid = false;
+    output->last_buffer = NULL;
+    draw(bar, output);
+}
+
+static void output_geometry(void *data, struct wl_output *wl_output,
+        int32_t x, int32_t y, int32_t physical_width, int32_t physical_height,
+        int32_t subpixel, const char *make, const char *model, int32_t transform) {
+    (void)data;
+    (void)wl_output;
+    (void)x;
+    (void)y;
+    (void)physical_width;
+    (void)physical_height;
+    (void)subpixel;
+    (void)make;
+    (void)model;
+    (void)transform;
+}
+
+static void output_mode(void *data, struct wl_output *wl_output,
+        uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
+    (void)data;
+    (void)wl_output;
+    (void)flags;
+    (void)width;
+    (void)height;
+    (void)refresh;
+}
+
+static void output_done(void *data, struct wl_output *wl_output) {
+    (void)wl_output;
+    output_update_scale(data);
+}
+
+static void output_scale(void *data, struct wl_output *wl_output, int32_t factor) {
+    struct bar_output *output = data;
+    (void)wl_output;
+
+    // Applied with the rest of the output's state on done
+    output->output_scale = factor;
+}
+
+static const struct wl_output_listener output_listener = {
+    .geometry = output_geometry,
+    .mode = output_mode,
+    .done = output_done,
+    .scale = output_scale,
+};
+
+static void fractional_scale_preferred(void *data,
+        struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale) {
+    struct bar_output *output = data;
+    (void)fractional_scale;
+
+    output->preferred_scale = scale;
+    output_update_scale(output);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+    .preferred_scale = fractional_scale_preferred,
+};
+
+/* Track a new output. Its bar shows up once output_create_surface has given
+ * it a layer surface and the compositor configured that. */
+static struct bar_output *output_add(struct limebar *bar, uint32_t name,
+        struct wl_output *wl_output) {
+    struct bar_output *output = calloc(1, sizeof(*output));
+    output->bar = bar;
+    output->name = name;
+    output->wl_output = wl_output;
+    output->width = bar->config->width;
+    output->height = bar->config->height;
+    output->output_scale = 1;
+    output->scale = SCALE_ONE;
+    output->shm_fd = -1;
+    output->dirty = true;
+
+    bar->outputs = grow_array(bar->outputs, &bar->outputs_cap,
+            bar->num_outputs + 1, sizeof(*bar->outputs));
+    bar->outputs[bar->num_outputs++] = output;
+    return output;
+}
+
+static bool output_create_surface(struct bar_output *output) {
+    struct limebar *bar = output->bar;
+
+    output->surface = wl_compositor_create_surface(bar->compositor);
+    if (!output->surface) {
+        fprintf(stderr, "Failed to create surface\n");
+        return false;
+    }
+
+    // Fractional scales need the viewport to size the surface
+    if (bar->viewporter)
+        output->viewport = wp_viewporter_get_viewport(bar->viewporter, output->surface);
+    if (bar->fractional_scale_manager && output->viewport) {
+        output->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+                bar->fractional_scale_manager, output->surface);
+        wp_fractional_scale_v1_add_listener(output->fractional_scale,
+                &fractional_scale_listener, output);
+    }
+    output_update_scale(output);
+
+    output->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+            bar->layer_shell, output->surface, output->wl_output,
+            ZWLR_LAYER_SHELL_V1_LAYER_TOP, "limebar");
+    if (!output->layer_surface) {
+        fprintf(stderr, "Failed to create layer surface\n");
+        return false;
+    }
+
+    // Set exclusive zone to reserve space
+    zwlr_layer_surface_v1_set_exclusive_zone(output->layer_surface, bar->config->height);
+
+    // Set size
+    zwlr_layer_surface_v1_set_size(output->layer_surface,
+            bar->config->width, bar->config->height);
+
+    // Set anchor based on position
+    uint32_t anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+    if (bar->config->position == POSITION_BOTTOM) {
+        anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
+    } else {
+        anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP;
+    }
+    zwlr_layer_surface_v1_set_anchor(output->layer_surface, anchor);
+    zwlr_layer_surface_v1_add_listener(output->layer_surface,
+            &layer_surface_listener, output);
+
+    // Commit the surface; the configure event brings the first frame
+    wl_surface_commit(output->surface);
+    return true;
+}
+
+/* Take the bar off an output, keeping track of the output itself. */
+static void output_destroy_surface(struct bar_output *output) {
+    if (output->frame_callback)
+        wl_callback_destroy(output->frame_callback);
+    output->frame_callback = NULL;
+    for (size_t i = 0; i < output->num_block_surfaces; i++)
+        block_surface_free(output->block_surfaces[i]);
+    free(output->block_surfaces);
+    output->block_surfaces = NULL;
+    output->num_block_surfaces = 0;
+    output->block_surfaces_cap = 0;
+    destroy_buffers(output);
+    destroy_shm_pool(output);
+    if (output->fractional_scale)
+        wp_fractional_scale_v1_destroy(output->fractional_scale);
+    if (output->viewport)
+        wp_viewport_destroy(output->viewport);
+    if (output->layer_surface)
+        zwlr_layer_surface_v1_destroy(output->layer_surface);
+    if (output->surface)
+        wl_surface_destroy(output->surface);
+    output->fractional_scale = NULL;
+    output->viewport = NULL;
+    output->layer_surface = NULL;
+    output->surface = NULL;
+}
+
+static void output_free(struct bar_output *output) {
+    output_destroy_surface(output);
+    if (output->wl_output)
+        wl_output_destroy(output->wl_output);
+    if (output->bar->output == output)
+        output->bar->output = NULL;
+    free(output);
+}
+
+static void shm_format(void *data, struct wl_shm *shm, uint32_t format) {
+    struct limebar *bar = data;
+    (void)shm;
+
+    if (format == WL_SHM_FORMAT_RGB565)
+        bar->shm_rgb565 = true;
+}
+
+static const struct wl_shm_listener shm_listener = {
+    .format = shm_format,
+};
+
+/* Free the output at index i; the render thread must be idle. */
+static void output_remove(struct limebar *bar, size_t i) {
+    output_free(bar->outputs[i]);
+    memmove(&bar->outputs[i], &bar->outputs[i + 1],
+            (bar->num_outputs - i - 1) * sizeof(*bar->outputs));
+    bar->num_outputs--;
+}
+
+static void registry_global(void *data, struct wl_registry *registry,
+        uint32_t name, const char *interface, uint32_t version) {
+    struct limebar *bar = data;
+
+    if (strcmp(interface, wl_compositor_interface.name) == 0) {
+        bar->compositor = wl_registry_bind(registry, name,
+                &wl_compositor_interface, 4);
+    } else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+        bar->subcompositor = wl_registry_bind(registry, name,
+                &wl_subcompositor_interface, 1);
+    } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
+        bar->layer_shell = wl_registry_bind(registry, name,
+                &zwlr_layer_shell_v1_interface, 1);
+    } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+        bar->shm = wl_registry_bind(registry, name,
+                &wl_shm_interface, 1);
+        wl_shm_add_listener(bar->shm, &shm_listener, bar);
+    } else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+        bar->viewporter = wl_registry_bind(registry, name,
+                &wp_viewporter_interface, 1);
+    } else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+        bar->fractional_scale_manager = wl_registry_bind(registry, name,
+                &wp_fractional_scale_manager_v1_interface, 1);
+    } else if (strcmp(interface, wl_output_interface.name) == 0) {
+        // The worker may be walking the outputs this grows
+        render_thread_idle(bar);
+
+        // A real output replaces the bar the compositor placed for us
+        if (bar->num_outputs == 1 && !bar->outputs[0]->wl_output)
+            output_remove(bar, 0);
+
+        // Version 2 sends the scale
+        struct bar_output *output = output_add(bar, name,
+                wl_registry_bind(registry, name, &wl_output_interface,
+                    version < 2 ? version : 2));
+        wl_output_add_listener(output->wl_output, &output_listener, output);
+
+        // Outputs plugged in later get their bar right away
+        if (bar->outputs_live)
+            output_create_surface(output);
+    }
+}
+
+static void registry_global_remove(void *data,
+        struct wl_registry *registry, uint32_t name) {
+    struct limebar *bar = data;
+    (void)registry;
+
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        if (bar->outputs[i]->wl_output && bar->outputs[i]->name == name) {
+            // The worker may be drawing for this output
+            render_thread_idle(bar);
+            output_remove(bar, i);
+            return;
+        }
+    }
+}
+
+/* Read whatever is available on fd into the reader. Returns the number of
+ * bytes read, 0 on EOF and -1 on error. */
+static ssize_t line_reader_fill(struct line_reader *reader, int fd) {
+    // Move the carried-over tail to the front before growing
+    if (reader->start > 0) {
+        memmove(reader->data, reader->data + reader->start, reader->len);
+        reader->start = 0;
+    }
+
+    if (reader->cap - reader->len < READ_CHUNK) {
+        size_t cap = reader->cap ? reader->cap : READ_CHUNK;
+        while (cap - reader->len < READ_CHUNK)
+            cap *= 2;
+        char *data = realloc(reader->data, cap);
+        if (!data) {
+            fprintf(stderr, "Failed to grow input buffer: %s\n", strerror(errno));
+            exit(1);
+        }
+        reader->data = data;
+        reader->cap = cap;
+    }
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(fd, reader->data + reader->len, reader->cap - reader->len);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read > 0)
+        reader->len += bytes_read;
+    return bytes_read;
+}
+
+/* Never let a producer that forgets newlines grow the buffer unbounded. */
+static void line_reader_limit(struct line_reader *reader) {
+    if (reader->len > MAX_LINE_LENGTH) {
+        fprintf(stderr, "Dropping input line longer than %d bytes\n", MAX_LINE_LENGTH);
+        reader->start = 0;
+        reader->len = 0;
+        reader->discard = true;
+    }
+}
+
+/* Consume every complete line in the reader and return the last one,
+ * NUL-terminated in place with its length in *len, or NULL if no line was
+ * completed. The pointer stays valid until the next line_reader_fill(). */
+static char *line_reader_last_line(struct line_reader *reader, size_t *len) {
+    char *begin = reader->data + reader->start;
+    char *end = begin + reader->len;
+    char *last_line = NULL;
+
+    char *line = begin;
+    char *newline;
+    while ((newline = memchr(line, '\n', end - line))) {
+        *newline = '\0';
+        if (reader->discard)
+            reader->discard = false;
+        else {
+            last_line = line;
+            *len = newline - line;
+            reader->lines++;
+        }
+        line = newline + 1;
+    }
+
+    reader->start += line - begin;
+    reader->len = end - line;
+    line_reader_limit(reader);
+
+    return last_line;
+}
+
+/* Frame the i3bar stream: a header object, then an endless array of status
+ * arrays. The scanner keeps its state across reads, so every byte is looked
+ * at once however the input is split. Consumes every complete status and
+ * returns the newest, like line_reader_last_line(). */
+static char *json_stream_next(struct line_reader *reader, struct json_stream *stream,
+        size_t *len) {
+    char *begin = reader->data + reader->start;
+    char *status = NULL;
+    size_t consumed = 0;
+
+    for (size_t i = stream->scanned; i < reader->len; i++) {
+        char c = begin[i];
+        if (stream->in_string) {
+            if (stream->escape)
+                stream->escape = false;
+            else if (c == '\\')
+                stream->escape = true;
+            else if (c == '"')
+                stream->in_string = false;
+            continue;
+        }
+
+        switch (c) {
+            case '"':
+                stream->in_string = true;
+                break;
+            case '{':
+            case '[':
+                if (stream->depth == 0 && c == '[')
+                    stream->in_body = true;
+                else if (stream->depth == 1 && stream->in_body)
+                    stream->status_start = i;
+                stream->depth++;
+                break;
+            case '}':
+            case ']':
+                if (stream->depth > 0)
+                    stream->depth--;
+                if (stream->depth == 1 && stream->in_body) {
+                    status = begin + stream->status_start;
+                    *len = i + 1 - stream->status_start;
+                    consumed = i + 1;
+                    reader->lines++;
+                } else if (stream->depth == 0) {
+                    // Header done, or the producer closed the stream
+                    stream->in_body = false;
+                    consumed = i + 1;
+                }
+                break;
+        }
+    }
+
+    stream->scanned = reader->len - consumed;
+    stream->status_start -= consumed < stream->status_start ? consumed : stream->status_start;
+    reader->start += consumed;
+    reader->len -= consumed;
+
+    if (reader->len > MAX_LINE_LENGTH) {
+        fprintf(stderr, "Dropping JSON status longer than %d bytes\n", MAX_LINE_LENGTH);
+        reader->start = 0;
+        reader->len = 0;
+        stream->scanned = 0;
+        stream->depth = stream->in_body ? 1 : 0;
+        stream->in_string = false;
+        stream->escape = false;
+    }
+    return status;
+}
+
+/* Consume the next complete line, NUL-terminated in place, or return NULL
+ * if there is none yet. Same lifetime as line_reader_last_line(). */
+static char *line_reader_next_line(struct line_reader *reader, size_t *len) {
+    while (reader->len > 0) {
+        char *line = reader->data + reader->start;
+        char *newline = memchr(line, '\n', reader->len);
+        if (!newline)
+            break;
+
+        size_t consumed = newline - line + 1;
+        *newline = '\0';
+        reader->start += consumed;
+        reader->len -= consumed;
+        if (reader->discard) {
+            reader->discard = false;
+            continue;
+        }
+
+        reader->lines++;
+        *len = consumed - 1;
+        return line;
+    }
+
+    line_reader_limit(reader);
+    return NULL;
+}
+
+static void modules_watch(struct limebar *bar);
+
+/* Work out what is shown. Without socket blocks that is just the parsed
+ * line. Otherwise a socket block takes the place of the line block with its
+ * id, and the remaining socket blocks follow the line in creation order. */
+static void merge_blocks(struct limebar *bar) {
+    if (bar->num_socket_blocks == 0) {
+        bar->blocks = bar->line_blocks;
+        bar->num_blocks = bar->num_line_blocks;
+        return;
+    }
+
+    bar->block_list = grow_array(bar->block_list, &bar->block_list_cap,
+            bar->num_line_blocks + bar->num_socket_blocks, sizeof(struct text_block));
+    for (size_t i = 0; i < bar->num_socket_blocks; i++) {
+        bar->socket_blocks[i].index = -1;
+        bar->socket_blocks[i].in_line = false;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < bar->num_line_blocks; i++) {
+        struct text_block *block = &bar->block_list[count];
+        *block = bar->line_blocks[i];
+        for (size_t j = 0; block->id && j < bar->num_socket_blocks; j++) {
+            struct socket_block *socket_block = &bar->socket_blocks[j];
+            if (strcmp(socket_block->id, block->id) == 0) {
+                socket_block->index = count;
+                socket_block->in_line = true;
+                if (socket_block->text_only)
+                    block->text = socket_block->block.text;
+                else
+                    *block = socket_block->block;
+                break;
+            }
+        }
+        count++;
+    }
+    for (size_t i = 0; i < bar->num_socket_blocks; i++) {
+        struct socket_block *socket_block = &bar->socket_blocks[i];
+        if (socket_block->index < 0) {
+            socket_block->index = count;
+            bar->block_list[count++] = socket_block->block;
+        }
+    }
+
+    bar->blocks = bar->block_list;
+    bar->num_blocks = count;
+}
+
+static struct json_block *get_json_block(struct limebar *bar, uint32_t key,
+        const struct json_block_id *id) {
+    for (size_t i = 0; i < bar->num_json_blocks; i++) {
+        struct json_block *named = &bar->json_blocks[i];
+        if (named->key == key && named->name_len == id->name_len &&
+                named->instance_len == id->instance_len &&
+                memcmp(named->id, id->name, id->name_len) == 0 &&
+                memcmp(named->id + id->name_len, id->instance, id->instance_len) == 0)
+            return named;
+    }
+
+    bar->json_blocks = grow_array(bar->json_blocks, &bar->json_blocks_cap,
+            bar->num_json_blocks + 1, sizeof(struct json_block));
+    struct json_block *named = &bar->json_blocks[bar->num_json_blocks++];
+    memset(named, 0, sizeof(*named));
+    named->key = key;
+    named->id = malloc(id->name_len + id->instance_len + 1);
+    if (!named->id) {
+        fprintf(stderr, "Failed to allocate block id: %s\n", strerror(errno));
+        exit(1);
+    }
+    memcpy(named->id, id->name, id->name_len);
+    memcpy(named->id + id->name_len, id->instance, id->instance_len);
+    named->name_len = id->name_len;
+    named->instance_len = id->instance_len;
+    return named;
+}
+
+/* Parse an i3bar status array. Named blocks whose object didn't change are
+ * taken from the previous status as they are; the others are unescaped in
+ * place, named ones in their own arena and the rest in the block arena. */
+static struct text_block *parse_json_status(struct limebar *bar, const char *input,
+        size_t len, size_t *num_blocks) {
+    size_t max_blocks = 0;
+    for (const char *p = input; (p = memchr(p, '{', input + len - p)); p++)
+        max_blocks++;
+
+    struct arena *arena = &bar->block_arena;
+    arena_reset(arena, ARENA_ALIGN(max_blocks * sizeof(struct text_block))
+            + ARENA_ALIGN(len + 1));
+    struct text_block *blocks = arena_alloc(arena, max_blocks * sizeof(struct text_block));
+    char *str = arena_alloc(arena, len + 1);
+    memcpy(str, input, len);
+    str[len] = '\0';
+    bar->json_status++;
+
+    size_t count = 0;
+    char *end = str + len;
+    char *p = json_skip_ws(str + 1, end);
+    while (p < end && *p == '{') {
+        char *object_end = json_skip_value(p, end);
+        if (!object_end)
+            break;
+
+        struct text_block *block = &blocks[count];
+        struct json_block_id id;
+        uint32_t key = json_block_key(p, object_end, &id);
+        struct json_block *named = key ? get_json_block(bar, key, &id) : NULL;
+
+        // A name seen twice in one status is parsed like an unnamed block
+        if (named && named->seen != bar->json_status) {
+            size_t size = object_end - p;
+            uint32_t hash = hash_bytes(p, size, 2166136261u);
+            if (hash != named->hash || size != named->object_len ||
+                    memcmp(p, named->object, size) != 0) {
+                // Keep the object as sent; the block is unescaped from a copy
+                arena_reset(&named->arena, ARENA_ALIGN(size) + ARENA_ALIGN(size + 1));
+                char *object = arena_alloc(&named->arena, size);
+                memcpy(object, p, size);
+                char *copy = arena_alloc(&named->arena, size + 1);
+                memcpy(copy, p, size);
+                copy[size] = '\0';
+                named->hash = hash;
+                named->object = object;
+                named->object_len = size;
+                named->valid = json_parse_block(copy, copy + size, &named->block,
+                        &bar->colors);
+            }
+            named->seen = bar->json_status;
+            if (named->valid) {
+                *block = named->block;
+                count++;
+            }
+        } else if (json_parse_block(p, object_end, block, &bar->colors)) {
+            count++;
+        }
+
+        p = json_skip_ws(object_end, end);
+        if (p < end && *p == ',')
+            p = json_skip_ws(p + 1, end);
+    }
+
+    // Forget blocks that left the status
+    for (size_t i = 0; i < bar->num_json_blocks; ) {
+        struct json_block *named = &bar->json_blocks[i];
+        if (named->seen == bar->json_status) {
+            i++;
+            continue;
+        }
+        free(named->arena.data);
+        free(named->id);
+        *named = bar->json_blocks[--bar->num_json_blocks];
+    }
+
+    *num_blocks = count;
+    return blocks;
+}
+
+/* Replace the blocks with the ones in line and mark the bar dirty; lines
+ * arriving before the next frame replace these in turn. */
+static void set_blocks_from_line(struct limebar *bar, const char *line, size_t len) {
+    uint64_t start = now_ns();
+
+    // i3bar producers resend the whole status on every tick
+    if (bar->config->json) {
+        if (bar->json_status && len == bar->json_line_len &&
+                memcmp(line, bar->json_line, len) == 0)
+            return;
+        bar->json_line = grow_array(bar->json_line, &bar->json_line_cap, len, 1);
+        memcpy(bar->json_line, line, len);
+        bar->json_line_len = len;
+    }
+
+    // The previous update never made it to the screen
+    if (any_dirty(bar))
+        bar->stats.frames_coalesced++;
+
+    // The arena is reused, not freed
+    if (bar->config->json) {
+        bar->line_blocks = parse_json_status(bar, line, len, &bar->num_line_blocks);
+    } else if (bar->config->raw_mode) {
+        bar->line_blocks = parse_raw_input(line, len, bar->text_color,
+                &bar->block_arena, &bar->num_line_blocks);
+    } else {
+        uint32_t refs = 0;
+        bar->line_blocks = parse_input(line, len, &bar->block_arena, &bar->colors,
+                bar->modules, &refs, &bar->num_line_blocks);
+
+        // Keep the line around to re-expand when a module changes
+        if (refs && line != bar->line) {
+            bar->line = grow_array(bar->line, &bar->line_cap, len + 1, 1);
+            memcpy(bar->line, line, len);
+            bar->line[len] = '\0';
+            bar->line_len = len;
+        }
+        if (refs != bar->module_refs) {
+            bar->module_refs = refs;
+            modules_watch(bar);
+        }
+    }
+    merge_blocks(bar);
+    mark_dirty(bar);
+    bar->blocks_changed = true;
+
+    stats_stage(&bar->stats, STAGE_PARSE, start);
+    TRACE(TRACE_DETAIL, "parsed %zu blocks from %zu bytes\n", bar->num_blocks, len);
+}
+
+/* Once stdin is closed, show what is left in the reader: the last line
+ * even without its newline, or a status that completed with the last read. */
+static void read_stdin_tail(struct limebar *bar) {
+    struct line_reader *reader = &bar->input;
+    size_t len = 0;
+    char *line = NULL;
+
+    if (bar->config->json) {
+        line = json_stream_next(reader, &bar->json, &len);
+    } else if (reader->len > 0 && !reader->discard) {
+        reader->data = grow_array(reader->data, &reader->cap,
+                reader->start + reader->len + 1, 1);
+        line = reader->data + reader->start;
+        len = reader->len;
+        line[len] = '\0';
+        reader->start += len;
+        reader->len = 0;
+        reader->lines++;
+    }
+    if (!line)
+        return;
+
+    bar->stats.lines_read++;
+    set_blocks_from_line(bar, line, len);
+    render_frame(bar);
+}
+
+/* Read what is available on stdin and queue its newest line for drawing.
+ * Returns false once stdin is at EOF or failed. */
+static bool read_stdin(struct limebar *bar) {
+    uint64_t start = now_ns();
+    if (line_reader_fill(&bar->input, STDIN_FILENO) <= 0) {
+        read_stdin_tail(bar);
+        return false;
+    }
+
+    // Only the newest complete line of a batch is worth parsing
+    unsigned long lines = bar->input.lines;
+    size_t len = 0;
+    char *line;
+    if (bar->config->json)
+        line = json_stream_next(&bar->input, &bar->json, &len);
+    else
+        line = line_reader_last_line(&bar->input, &len);
+    stats_stage(&bar->stats, STAGE_READ, start);
+    if (!line)
+        return true;
+
+    lines = bar->input.lines - lines;
+    bar->stats.lines_read += lines;
+    bar->stats.frames_coalesced += lines - 1;
+    TRACE(TRACE_DETAIL, "read %lu lines, keeping the last\n", lines);
+
+    set_blocks_from_line(bar, line, len);
+    render_frame(bar);
+    return true;
+}
+
+/* Write the counters and stage timings as text. */
+static int format_stats(struct limebar *bar, char *out, size_t size) {
+    // The cache counters are the worker's while it draws
+    render_thread_idle(bar);
+
+    const struct stats *stats = &bar->stats;
+    int len = snprintf(out, size,
+        "frames drawn %lu shared %lu coalesced %lu unchanged %lu lines %lu\n"
+        "damage bytes %llu\n",
+        stats->frames_drawn, stats->frames_shared, stats->frames_coalesced,
+        stats->frames_unchanged, stats->lines_read,
+        (unsigned long long)stats->bytes_damaged);
+
+    for (int i = 0; i < NUM_STAGES && len < (int)size; i++) {
+        unsigned long count = stats->stage_count[i];
+        len += snprintf(out + len, size - len,
+            "stage %-6s count %lu avg %.1f us max %.1f us\n",
+            stage_names[i], count,
+            count ? stats->stage_ns[i] / 1000.0 / count : 0.0,
+            stats->stage_max_ns[i] / 1000.0);
+    }
+
+    if (len < (int)size) {
+        len += snprintf(out + len, size - len,
+            "cache layout hits %lu misses %lu\n"
+            "cache block hits %lu misses %lu evictions %lu kib %zu\n"
+            "cache color hits %lu misses %lu\n",
+            bar->layouts.hits, bar->layouts.misses,
+            bar->block_cache.hits, bar->block_cache.misses,
+            bar->block_cache.evictions, bar->block_cache.bytes / 1024,
+            bar->colors.hits, bar->colors.misses);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+static void dump_stats(struct limebar *bar) {
+    char text[2048];
+    format_stats(bar, text, sizeof(text));
+    fputs(text, stderr);
+}
+
+static void maybe_dump_stats(struct limebar *bar) {
+    if (!bar->config->stats_interval || now_ns() < bar->next_stats_ns)
+        return;
+    dump_stats(bar);
+    bar->next_stats_ns = now_ns() + (uint64_t)bar->config->stats_interval * 1000000000ull;
+}
+
+/* Tags for the event loop's epoll registrations; modules and control
+ * clients use EVENT_MODULE + module and EVENT_CLIENT + slot, block commands
+ * three tags each from EVENT_COMMAND on. */
+enum {
+    EVENT_STDIN,
+    EVENT_DISPLAY,
+    EVENT_TIMER,
+    EVENT_SIGNAL,
+    EVENT_CONTROL,
+    EVENT_RENDER,
+    EVENT_MODULE,
+    EVENT_CLIENT = EVENT_MODULE + NUM_MODULES,
+    EVENT_COMMAND = EVENT_CLIENT + MAX_CONTROL_CLIENTS,
+};
+
+static void watch_fd(struct limebar *bar, int fd, uint32_t tag) {
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = tag};
+    if (epoll_ctl(bar->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        fprintf(stderr, "Failed to watch fd %d: %s\n", fd, strerror(errno));
+        exit(1);
+    }
+}
+
+/* Start the timers of the modules the current line references and stop the
+ * rest. Without an event loop modules only show their first value. */
+static void modules_watch(struct limebar *bar) {
+    if (bar->epoll_fd < 0)
+        return;
+
+    for (int i = 0; i < NUM_MODULES; i++) {
+        struct module *module = &bar->modules[i];
+        bool used = bar->module_refs & 1u << i;
+        if (used == module->armed)
+            continue;
+
+        if (module->timer_fd < 0) {
+            module->timer_fd = timerfd_create(
+                    module->wall_clock ? CLOCK_REALTIME : CLOCK_MONOTONIC,
+                    TFD_NONBLOCK | TFD_CLOEXEC);
+            if (module->timer_fd < 0) {
+                fprintf(stderr, "Failed to create timer for {%s}: %s\n",
+                        module->name, strerror(errno));
+                continue;
+            }
+            watch_fd(bar, module->timer_fd, EVENT_MODULE + i);
+        }
+
+        struct itimerspec spec = {0};
+        int flags = 0;
+        if (used) {
+            spec.it_interval.tv_sec = module->interval;
+            spec.it_value.tv_sec = module->interval;
+            if (module->wall_clock) {
+                // First tick on the next whole second
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                spec.it_value.tv_sec = now.tv_sec + 1;
+                flags = TFD_TIMER_ABSTIME;
+            }
+        }
+        timerfd_settime(module->timer_fd, flags, &spec, NULL);
+        module->armed = used;
+    }
+}
+
+/* A module's timer fired: refresh its value and re-expand the line if what
+ * it shows changed. */
+static void module_tick(struct limebar *bar, int index) {
+    struct module *module = &bar->modules[index];
+    uint64_t expirations;
+    if (read(module->timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    char old[MODULE_TEXT_MAX];
+    memcpy(old, module->text, sizeof(old));
+    module->update(module);
+    if (strcmp(old, module->text) == 0 || !(bar->module_refs & 1u << index))
+        return;
+
+    TRACE(TRACE_DETAIL, "{%s} changed to %s\n", module->name, module->text);
+    set_blocks_from_line(bar, bar->line, bar->line_len);
+    render_frame(bar);
+}
+
+static void modules_finish(struct limebar *bar) {
+    for (int i = 0; i < NUM_MODULES; i++) {
+        if (bar->modules[i].fd >= 0)
+            close(bar->modules[i].fd);
+        if (bar->modules[i].timer_fd >= 0)
+            close(bar->modules[i].timer_fd);
+        free(bar->modules[i].buf);
+    }
+    free(bar->line);
+}
+
+/* Local control socket. Clients send newline terminated commands and get
+ * text replies on the same connection. */
+static bool control_open(struct limebar *bar, const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create control socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "Failed to bind control socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    bar->control_fd = fd;
+    return true;
+}
+
+static void control_accept(struct limebar *bar) {
+    int fd = accept4(bar->control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (bar->clients[i].fd < 0) {
+            bar->clients[i].fd = fd;
+            if (bar->epoll_fd >= 0)
+                watch_fd(bar, fd, EVENT_CLIENT + i);
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void control_disconnect(struct control_client *client) {
+    close(client->fd);
+    client->fd = -1;
+    client->input.start = 0;
+    client->input.len = 0;
+    client->input.discard = false;
+}
+
+static void control_reply(struct control_client *client, const char *text, size_t len) {
+    while (len > 0) {
+        ssize_t written = send(client->fd, text, len, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        text += written;
+        len -= written;
+    }
+}
+
+static struct socket_block *find_socket_block(struct limebar *bar, const char *id) {
+    for (size_t i = 0; i < bar->num_socket_blocks; i++) {
+        if (strcmp(bar->socket_blocks[i].id, id) == 0)
+            return &bar->socket_blocks[i];
+    }
+    return NULL;
+}
+
+static struct socket_block *get_socket_block(struct limebar *bar, const char *id) {
+    struct socket_block *socket_block = find_socket_block(bar, id);
+    if (!socket_block) {
+        bar->socket_blocks = grow_array(bar->socket_blocks, &bar->socket_blocks_cap,
+                bar->num_socket_blocks + 1, sizeof(struct socket_block));
+        socket_block = &bar->socket_blocks[bar->num_socket_blocks++];
+        memset(socket_block, 0, sizeof(*socket_block));
+        socket_block->id = strdup(id);
+        socket_block->index = -1;
+    }
+    return socket_block;
+}
+
+/* Patch a freshly parsed socket block into the shown blocks. Only a new
+ * block needs the blocks merged again; an existing one is replaced where it
+ * is. */
+static void socket_block_changed(struct limebar *bar, struct socket_block *socket_block) {
+    // Keep the id stable, whatever I= said
+    socket_block->block.id = socket_block->id;
+
+    if (socket_block->index < 0)
+        merge_blocks(bar);
+    else if (socket_block->text_only && socket_block->in_line)
+        bar->blocks[socket_block->index].text = socket_block->block.text;
+    else
+        bar->blocks[socket_block->index] = socket_block->block;
+    mark_dirty(bar);
+    bar->blocks_changed = true;
+}
+
+/* "set <id> <attrs>:<text>": parse the block into its own arena and patch
+ * it into the shown blocks. spec is "<attrs>:<text>" inside the command
+ * line, with one writable byte before and after it. */
+static const char *set_socket_block(struct limebar *bar, const char *id, char *spec, size_t len) {
+    uint64_t start = now_ns();
+
+    // Anything else would not parse into exactly one block
+    if (!memchr(spec, ':', len) || memchr(spec, ']', len))
+        return "error expected <attrs>:<text>\n";
+
+    struct socket_block *socket_block = get_socket_block(bar, id);
+
+    // Reuse the block parser by turning the spec into "[<attrs>:<text>]".
+    // The byte before it ends id, so it is put back afterwards.
+    char before = spec[-1];
+    spec[-1] = '[';
+    spec[len] = ']';
+    size_t count;
+    struct text_block *block = parse_input(spec - 1, len + 2, &socket_block->arena,
+            &bar->colors, NULL, NULL, &count);
+    spec[-1] = before;
+    spec[len] = '\0';
+
+    socket_block->block = *block;
+    socket_block->text_only = false;
+    socket_block_changed(bar, socket_block);
+
+    stats_stage(&bar->stats, STAGE_PARSE, start);
+    TRACE(TRACE_DETAIL, "set block %s\n", id);
+    render_frame(bar);
+    return "ok\n";
+}
+
+static const char *remove_socket_block(struct limebar *bar, const char *id) {
+    struct socket_block *socket_block = find_socket_block(bar, id);
+    if (!socket_block)
+        return "error unknown block\n";
+
+    free(socket_block->id);
+    free(socket_block->arena.data);
+    *socket_block = bar->socket_blocks[--bar->num_socket_blocks];
+    merge_blocks(bar);
+    mark_dirty(bar);
+    bar->blocks_changed = true;
+    render_frame(bar);
+    return "ok\n";
+}
+
+static void control_command(struct limebar *bar, struct control_client *client,
+        char *line, size_t len) {
+    char reply[2048];
+
+    if (strcmp(line, "stats") == 0) {
+        int reply_len = format_stats(bar, reply, sizeof(reply));
+        control_reply(client, reply, reply_len);
+        return;
+    }
+
+    const char *result = "error unknown command\n";
+    if (strncmp(line, "set ", 4) == 0) {
+        char *id = line + 4;
+        char *space = strchr(id, ' ');
+        if (space && space != id) {
+            *space = '\0';
+            result = set_socket_block(bar, id, space + 1, line + len - (space + 1));
+        } else {
+            result = "error usage: set <id> <attrs>:<text>\n";
+        }
+    } else if (strncmp(line, "remove ", 7) == 0) {
+        result = remove_socket_block(bar, line + 7);
+    }
+    control_reply(client, result, strlen(result));
+}
+
+static void control_read(struct limebar *bar, struct control_client *client) {
+    ssize_t bytes_read = line_reader_fill(&client->input, client->fd);
+    if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN)) {
+        control_disconnect(client);
+        return;
+    }
+
+    size_t len;
+    char *line;
+    while ((line = line_reader_next_line(&client->input, &len)))
+        control_command(bar, client, line, len);
+}
+
+static void control_close(struct limebar *bar) {
+    for (size_t i = 0; i < bar->num_socket_blocks; i++) {
+        free(bar->socket_blocks[i].id);
+        free(bar->socket_blocks[i].arena.data);
+    }
+    free(bar->socket_blocks);
+    free(bar->block_list);
+
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (bar->clients[i].fd >= 0)
+            control_disconnect(&bar->clients[i]);
+        free(bar->clients[i].input.data);
+    }
+    if (bar->control_fd >= 0) {
+        close(bar->control_fd);
+        unlink(bar->config->control_path);
+    }
+}
+
+/* Expand the frame number into a --dump path. Only %d, %u and %i with an
+ * optional 0 flag and width are replaced, and %% is a literal '%'; anything
+ * else is copied as is, so the path is never used as a printf format. */
+static void dump_path_format(char *path, size_t size, const char *pattern,
+        unsigned long frame) {
+    size_t len = 0;
+    while (*pattern && len + 1 < size) {
+        if (pattern[0] == '%' && pattern[1] == '%') {
+            path[len++] = '%';
+            pattern += 2;
+            continue;
         }
+        if (pattern[0] == '%') {
+            const char *spec = pattern + 1;
+            bool zero = *spec == '0';
+            int width = 0;
+            while (*spec >= '0' && *spec <= '9' && width < 64)
+                width = width * 10 + (*spec++ - '0');
+            if (*spec == 'd' || *spec == 'u' || *spec == 'i') {
+                int written = snprintf(path + len, size - len,
+                        zero ? "%0*lu" : "%*lu", width, frame);
+                len += written < (int)(size - len) ? (size_t)written : size - len - 1;
+                pattern = spec + 1;
+                continue;
+            }
+        }
+        path[len++] = *pattern++;
+    }
+    path[len] = '\0';
+}
+
+/* Headless backend: frames are rendered into the same buffers, but nothing
+ * is attached to a surface. A frame can be written out after each draw, as
+ * PNG when the path ends in .png and as raw rows in the buffer format
+ * (ARGB32, XRGB32 or RGB565) otherwise. A %d in the path, with an optional
+ * width like %04d, is replaced by the frame number. */
+static void headless_present(struct limebar *bar, struct pool_buffer *buf) {
+    const char *dump = bar->config->dump_path;
+    if (!dump)
+        return;
+
+    char path[4096];
+    dump_path_format(path, sizeof(path), dump, bar->stats.frames_drawn);
+
+    cairo_surface_flush(buf->cairo_surface);
+    size_t len = strlen(path);
+    if (len >= 4 && strcmp(path + len - 4, ".png") == 0) {
+        if (cairo_surface_write_to_png(buf->cairo_surface, path) != CAIRO_STATUS_SUCCESS)
+            fprintf(stderr, "Failed to write %s\n", path);
+        return;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fwrite(buf->data, cairo_image_surface_get_stride(buf->cairo_surface), buf->height, file);
+    fclose(file);
+}
+
+/* Render one frame per stdin line without a Wayland connection. */
+static int run_headless(struct limebar *bar) {
+    struct bar_output *output = output_add(bar, 0, NULL);
+    create_buffers(output);
+    draw(bar, output);
+
+    while (read_stdin(bar)) {
+        render_frame(bar);
+        maybe_dump_stats(bar);
     }
+    return 0;
+}
+
+#ifdef LIMEBAR_COUNT_ALLOCS
+/* Benchmark builds count every heap allocation in the process, including
+ * the ones made inside pango, cairo and glib. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
 }
 
-struct text_block {
-    char *text;
-    char *fg_color;
-    char *bg_color;
-    char *underline_color;
-    int font_index;
-    bool underline;
-    enum {
-        ALIGN_LEFT,
-        ALIGN_CENTER,
-        ALIGN_RIGHT
-    } alignment;
-    struct text_block *next;
-};
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
 
+/* Synthetic producers for the benchmark; each writes the line for frame n. */
+static void bench_line_blocks(char *line, size_t size, long n) {
+    // Many static blocks (a long workspace list) and one ticking clock
+    size_t len = 0;
+    for (int i = 0; i < 48 && len < size; i++)
+        len += snprintf(line + len, size - len, "[F=#%06x:ws %d]", 0x808080 + i * 0x010101, i + 1);
+    if (len < size)
+        snprintf(line + len, size - len, "[F=#ffffff,A=r:12:%02ld:%02ld]", n / 60 % 60, n % 60);
+}
 
-struct limebar {
-    struct wl_display *display;
-    struct wl_registry *registry;
-    struct wl_compositor *compositor;
-    struct wl_surface *surface;
-    struct wl_shm *shm;
-    struct zwlr_layer_shell_v1 *layer_shell;
-    struct zwlr_layer_surface_v1 *layer_surface;
-    uint32_t width;
-    uint32_t height;
-    struct wl_buffer *buffer;
-    cairo_surface_t *cairo_surface;
-    cairo_t *cairo;
-    void *shm_data;
-    PangoContext *pango_context;
-    PangoLayout *pango_layout;
-    struct text_block *blocks;
-    char **fonts;
-    int num_fonts;
+static void bench_line_long(char *line, size_t size, long n) {
+    // Long titles, one of them scrolling
+    static const char words[] = "the quick brown fox jumps over the lazy dog ";
+    char title[640];
+    for (size_t i = 0; i < sizeof(title) - 1; i++)
+        title[i] = words[(i + n) % (sizeof(words) - 1)];
+    title[sizeof(title) - 1] = '\0';
+    snprintf(line, size, "[F=#ff606c:%.600s] [A=c:%s] [A=r:%.300s]", words, title, words);
+}
 
-      struct bar_config *config;  // Add this
+static void bench_line_colors(char *line, size_t size, long n) {
+    // Every block changes color every frame
+    size_t len = 0;
+    for (int i = 0; i < 24 && len < size; i++) {
+        uint32_t color = (uint32_t)(n * 2654435761u + i * 40503u) & 0xffffff;
+        len += snprintf(line + len, size - len, "[F=#%06x,B=#%06x,u:blk%d]",
+                color, ~color & 0xffffff, i);
+    }
+}
 
-    struct {
-            double r, g, b, a;
-        } bg_color;
+static void bench_line_rate(char *line, size_t size, long n) {
+    // A dozen counters that all tick every frame
+    size_t len = 0;
+    for (int i = 0; i < 12 && len < size; i++)
+        len += snprintf(line + len, size - len, "[F=#00ff00:%d %ld.%ld]", i, n * (i + 1) / 10, n % 10);
+}
+
+static void bench_line_clock(char *line, size_t size, long n) {
+    // A clock with milliseconds and a few rates, all from the glyph atlas
+    snprintf(line, size, "[N=5:%ld.%ld%%][N=8:%ld.%02ld][A=r,N=12:12:%02ld:%02ld.%03ld]",
+            n % 100, n % 10, n * 37 % 10000, n % 100, n / 600 % 60, n / 10 % 60, n * 100 % 1000);
+}
+
+static const struct {
+    const char *name;
+    void (*make_line)(char *line, size_t size, long n);
+} bench_scenarios[] = {
+    {"blocks", bench_line_blocks},
+    {"long", bench_line_long},
+    {"colors", bench_line_colors},
+    {"rate", bench_line_rate},
+    {"clock", bench_line_clock},
 };
 
-static struct text_block *parse_input(const char *input) {
-    printf("Parsing input: %s\n", input);
-    struct text_block *head = NULL;
-    struct text_block *current = NULL;
+static int compare_u64(const void *a, const void *b) {
+    uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+    return (ua > ub) - (ua < ub);
+}
+
+/* Feed frames synthetic lines through parse and draw on the headless
+ * backend and report per-frame latency percentiles. */
+static int run_bench(struct limebar *bar, const char *scenario, long frames) {
+    static char line[16384];
+    uint64_t *times = malloc(sizeof(*times) * frames);
+    bool found = false;
 
-    char *str = strdup(input);
-    char *saveptr1;
-    char *token = strtok_r(str, "[]", &saveptr1);
+    struct bar_output *output = output_add(bar, 0, NULL);
+    create_buffers(output);
+    printf("%-8s %8s %9s %9s %9s %9s %12s\n",
+           "scenario", "frames", "p50 us", "p90 us", "p99 us", "max us", "allocs/frame");
 
-    while (token) {
-        // Skip leading whitespace
-        while (*token == ' ') token++;
-
-        if (strchr(token, ':')) {
-            struct text_block *block = calloc(1, sizeof(struct text_block));
-
-            char *attrs_text = strdup(token);
-            char *saveptr2;
-            char *attrs = strtok_r(attrs_text, ":", &saveptr2);
-            char *text = strtok_r(NULL, ":", &saveptr2);
-
-            printf("Parsing block - attrs: %s, text: %s\n", attrs, text);
-
-            char *saveptr3;
-            char *attr = strtok_r(attrs, ",", &saveptr3);
-            while (attr) {
-                printf("Processing attribute: %s\n", attr);
-                switch (attr[0]) {
-                    case 'F':
-                        block->fg_color = strdup(attr + 2);
-                        printf("Set fg_color: %s\n", block->fg_color);
-                        break;
-                    case 'B':
-                        block->bg_color = strdup(attr + 2);
-                        break;
-                    case 'U':
-                        block->underline_color = strdup(attr + 2);
-                        break;
-                    case 'T':
-                        block->font_index = atoi(attr + 2) - 1;
-                        break;
-                    case 'u':
-                        block->underline = true;
-                        printf("Set underline: true\n");
-                        break;
-                }
-                attr = strtok_r(NULL, ",", &saveptr3);
-            }
+    for (size_t s = 0; s < sizeof(bench_scenarios) / sizeof(bench_scenarios[0]); s++) {
+        if (strcmp(scenario, "all") != 0 && strcmp(scenario, bench_scenarios[s].name) != 0)
+            continue;
+        found = true;
 
-            block->text = text ? strdup(text) : strdup("");
+        // Warm the caches and arenas up first
+        for (long n = 0; n < 10; n++) {
+            bench_scenarios[s].make_line(line, sizeof(line), n);
+            set_blocks_from_line(bar, line, strlen(line));
+            draw(bar, output);
+        }
 
-            if (!head) {
-                head = block;
-                current = block;
-            } else {
-                current->next = block;
-                current = block;
-            }
-            free(attrs_text);
+#ifdef LIMEBAR_COUNT_ALLOCS
+        unsigned long allocs = alloc_count;
+#endif
+        for (long n = 0; n < frames; n++) {
+            bench_scenarios[s].make_line(line, sizeof(line), n + 10);
+            uint64_t start = now_ns();
+            set_blocks_from_line(bar, line, strlen(line));
+            draw(bar, output);
+            times[n] = now_ns() - start;
         }
-        token = strtok_r(NULL, "[]", &saveptr1);
+#ifdef LIMEBAR_COUNT_ALLOCS
+        double allocs_per_frame = (double)(alloc_count - allocs) / frames;
+#endif
+
+        qsort(times, frames, sizeof(*times), compare_u64);
+        printf("%-8s %8ld %9.1f %9.1f %9.1f %9.1f ",
+               bench_scenarios[s].name, frames,
+               times[frames / 2] / 1000.0,
+               times[frames * 90 / 100] / 1000.0,
+               times[frames * 99 / 100] / 1000.0,
+               times[frames - 1] / 1000.0);
+#ifdef LIMEBAR_COUNT_ALLOCS
+        printf("%12.1f\n", allocs_per_frame);
+#else
+        printf("%12s\n", "n/a");
+#endif
     }
 
-    // Print all blocks for debugging
-    struct text_block *block = head;
-    while (block) {
-        printf("Block - text: %s, fg_color: %s, underline: %d\n",
-               block->text, block->fg_color ? block->fg_color : "none",
-               block->underline);
-        block = block->next;
+    free(times);
+    if (!found) {
+        fprintf(stderr, "Unknown benchmark scenario: %s\n", scenario);
+        return 1;
     }
+    return 0;
+}
+
+/* Microbenchmark for the block parser: time per parsed line and how often
+ * the arena had to allocate once warmed up (should be zero). */
+static void bench_parse(long iterations) {
+    static const char line[] =
+        "[F=#f66a22:  ] [F=#00ff00,u:CPU 12.5%] [F=#ffffff,B=#333333:MEM 3.1G/15.5G] "
+        "[F=#ffff00,U=#ff0000,u:BAT 87%] [T=2:12:34:56] [F=#ff606c:vol 42%]";
+    struct arena arena = {0};
+    struct color_cache colors = {0};
+    size_t num_blocks;
 
-    free(str);
-    return head;
+    // Warm up so the arena reaches its steady-state size
+    parse_input(line, sizeof(line) - 1, &arena, &colors, NULL, NULL, &num_blocks);
+    unsigned long warm_grows = arena.grows;
+
+#ifdef LIMEBAR_COUNT_ALLOCS
+    unsigned long allocs = alloc_count;
+#endif
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; i++)
+        parse_input(line, sizeof(line) - 1, &arena, &colors, NULL, NULL, &num_blocks);
+    uint64_t elapsed = now_ns() - start;
+#ifdef LIMEBAR_COUNT_ALLOCS
+    allocs = alloc_count - allocs;
+#endif
+
+    printf("parse: %ld iterations, %zu blocks/line, %.1f ns/line, "
+           "%lu arena grows after warm-up",
+           iterations, num_blocks, (double)elapsed / iterations,
+           arena.grows - warm_grows);
+#ifdef LIMEBAR_COUNT_ALLOCS
+    printf(", %lu heap allocations\n", allocs);
+#else
+    printf("\n");
+#endif
+
+    free(arena.data);
 }
 
-static void registry_global(void *data, struct wl_registry *registry,
-        uint32_t name, const char *interface, uint32_t version);
-static void registry_global_remove(void *data,
-        struct wl_registry *registry, uint32_t name);
+/* One frame's worth of solid fills on a bar: the background, a row of
+ * opaque block backgrounds and their underlines, through cairo or, where
+ * possible, the fill kernels. */
+static void bench_fill_frame(cairo_t *cr, int width, int height, int blocks, bool direct) {
+    int block_width = width / blocks;
 
-static const struct wl_registry_listener registry_listener = {
-    .global = registry_global,
-    .global_remove = registry_global_remove,
-};
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    if (!direct || !fill_solid(cr, 0, 0, width, height, 0xff1a1a1a)) {
+        set_source_color(cr, 0xff1a1a1a);
+        cairo_paint(cr);
+    }
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
-static void create_buffer(struct limebar *bar) {
-    int stride = bar->width * 4;
-    int size = stride * bar->height;
+    for (int i = 0; i < blocks; i++) {
+        int x = i * block_width;
+        uint32_t bg = 0xff000000 | (uint32_t)i * 0x030303;
+        if (!direct || !fill_solid(cr, x + 2, 2, block_width - 4, height - 4, bg)) {
+            set_source_color(cr, bg);
+            cairo_rectangle(cr, x + 2, 2, block_width - 4, height - 4);
+            cairo_fill(cr);
+        }
+        if (!direct || !fill_solid(cr, x + 4, height - 6, block_width - 8, 2, 0xffff0000)) {
+            set_source_color(cr, 0xffff0000);
+            cairo_set_line_width(cr, 2);
+            cairo_move_to(cr, x + 4, height - 5);
+            cairo_line_to(cr, x + block_width - 4, height - 5);
+            cairo_stroke(cr);
+        }
+    }
+    cairo_surface_flush(cairo_get_target(cr));
+}
 
-    char name[] = "/tmp/limebar-XXXXXX";
-    int fd = mkstemp(name);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to create temp file: %s\n", strerror(errno));
-        exit(1);
+/* Microbenchmark for the solid fills on 4K and 8K wide bars: time per frame
+ * through cairo and through every fill kernel this CPU can run. */
+static void bench_fill(long iterations) {
+    static const int widths[] = {3840, 7680};
+    const int height = 32, blocks = 40;
+    struct {
+        const char *name;
+        fill_row_fn fn;
+    } kernels[3] = {{"scalar", fill_row_scalar}};
+    int num_kernels = 1;
+#ifdef LIMEBAR_X86_FILL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[num_kernels].name = "sse2", kernels[num_kernels++].fn = fill_row_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        kernels[num_kernels].name = "avx2", kernels[num_kernels++].fn = fill_row_avx2;
+#endif
+    fill_row_fn selected = fill_row;
+
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        int width = widths[w];
+        int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+        unsigned char *data = calloc(height, stride);
+        cairo_surface_t *surface = cairo_image_surface_create_for_data(data,
+                CAIRO_FORMAT_ARGB32, width, height, stride);
+        cairo_t *cr = cairo_create(surface);
+
+        for (int k = -1; k < num_kernels; k++) {
+            if (k >= 0)
+                fill_row = kernels[k].fn;
+            bench_fill_frame(cr, width, height, blocks, k >= 0);    // Warm up
+
+            uint64_t start = now_ns();
+            for (long i = 0; i < iterations; i++)
+                bench_fill_frame(cr, width, height, blocks, k >= 0);
+            uint64_t elapsed = now_ns() - start;
+
+            printf("fill: %dx%d %-6s %8.1f us/frame\n", width, height,
+                   k >= 0 ? kernels[k].name : "cairo", elapsed / 1000.0 / iterations);
+        }
+
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+        free(data);
     }
-    unlink(name);
+    fill_row = selected;
+}
 
-    if (ftruncate(fd, size) == -1) {
-        fprintf(stderr, "Failed to set file size: %s\n", strerror(errno));
-        close(fd);
-        exit(1);
+/* Block commands. Each one has its own timerfd; the first runs are spread
+ * over the interval so commands sharing an interval don't all start in the
+ * same millisecond. Children are watched through pidfds and their stdout is
+ * read without blocking. Failed runs back off exponentially. */
+#define COMMAND_BACKOFF_MAX 300     // Seconds
+
+static bool parse_command_spec(const char *spec, struct command_block *cmd) {
+    const char *colon = strchr(spec, ':');
+    const char *colon2 = colon ? strchr(colon + 1, ':') : NULL;
+    if (!colon || colon == spec || !colon2 || !colon2[1])
+        return false;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->id = strndup(spec, colon - spec);
+    cmd->interval = atoi(colon + 1);
+    if (cmd->interval < 0)
+        cmd->interval = 0;
+    cmd->command = strdup(colon2 + 1);
+    cmd->pidfd = -1;
+    cmd->out_fd = -1;
+    cmd->timer_fd = -1;
+    return true;
+}
+
+static int command_tag(int index, int kind) {
+    return EVENT_COMMAND + index * 3 + kind;
+}
+
+static void command_arm(struct command_block *cmd, uint64_t delay_ms, bool periodic) {
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = delay_ms / 1000,
+            .tv_nsec = delay_ms % 1000 * 1000000 + 1,   // Zero would disarm
+        },
+    };
+    if (periodic)
+        spec.it_interval.tv_sec = cmd->interval;
+    timerfd_settime(cmd->timer_fd, 0, &spec, NULL);
+    cmd->periodic = periodic;
+}
+
+static void command_spawn(struct limebar *bar, int index) {
+    struct command_block *cmd = &bar->commands[index];
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        fprintf(stderr, "Failed to create pipe for block %s: %s\n", cmd->id, strerror(errno));
+        return;
     }
 
-    bar->shm_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (bar->shm_data == MAP_FAILED) {
-        fprintf(stderr, "Failed to mmap: %s\n", strerror(errno));
-        close(fd);
-        exit(1);
+    // Children get stdout on the pipe, no stdin and default signal handling
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    extern char **environ;
+    char *argv[] = {"sh", "-c", cmd->command, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipefd[1]);
+    if (err) {
+        fprintf(stderr, "Failed to run block %s: %s\n", cmd->id, strerror(err));
+        close(pipefd[0]);
+        return;
     }
 
-    struct wl_shm_pool *pool = wl_shm_create_pool(bar->shm, fd, size);
-    bar->buffer = wl_shm_pool_create_buffer(pool, 0, bar->width, bar->height,
-            stride, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
-    close(fd);
+    cmd->pid = pid;
+    cmd->started_ns = now_ns();
+    cmd->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    cmd->out_fd = pipefd[0];
+    fcntl(cmd->out_fd, F_SETFL, O_NONBLOCK);
+    cmd->output.start = 0;
+    cmd->output.len = 0;
+    cmd->output.discard = false;
 
-    bar->cairo_surface = cairo_image_surface_create_for_data(bar->shm_data,
-            CAIRO_FORMAT_ARGB32, bar->width, bar->height, stride);
-    bar->cairo = cairo_create(bar->cairo_surface);
+    watch_fd(bar, cmd->out_fd, command_tag(index, 0));
+    if (cmd->pidfd >= 0)
+        watch_fd(bar, cmd->pidfd, command_tag(index, 1));
+    TRACE(TRACE_DETAIL, "started block %s as pid %d\n", cmd->id, (int)pid);
 }
 
-static void parse_color(const char *color_str, double *r, double *g, double *b) {
-    printf("Parsing color: %s\n", color_str);  // Debug print
-    if (color_str[0] == '#') {
-        unsigned int color;
-        sscanf(color_str + 1, "%x", &color);
-        *r = ((color >> 16) & 0xFF) / 255.0;
-        *g = ((color >> 8) & 0xFF) / 255.0;
-        *b = (color & 0xFF) / 255.0;
-        printf("Parsed color values: r=%f, g=%f, b=%f\n", *r, *g, *b);  // Debug print
-    } else {
-        *r = 1.0;
-        *g = 1.0;
-        *b = 1.0;
+static void command_exited(struct limebar *bar, int index);
+
+/* New output from a block command: its newest complete line replaces the
+ * block's text. A line starting with '[' is a full "[attrs:text]" block.
+ * The bar is only marked dirty; the event loop draws once per batch. */
+static void command_output(struct limebar *bar, int index) {
+    struct command_block *cmd = &bar->commands[index];
+    ssize_t bytes_read = line_reader_fill(&cmd->output, cmd->out_fd);
+    if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN)) {
+        close(cmd->out_fd);
+        cmd->out_fd = -1;
+        // Without pidfds, stdout closing is the best sign the child is done
+        if (cmd->pidfd < 0 && cmd->pid)
+            command_exited(bar, index);
+        return;
     }
+
+    size_t len = 0;
+    char *line = line_reader_last_line(&cmd->output, &len);
+    if (!line)
+        return;
+
+    // Periodic commands mostly print what they printed last time
+    if (cmd->last_line && len == cmd->last_line_len &&
+            memcmp(line, cmd->last_line, len) == 0 && find_socket_block(bar, cmd->id))
+        return;
+    cmd->last_line = grow_array(cmd->last_line, &cmd->last_line_cap, len + 1, 1);
+    memcpy(cmd->last_line, line, len);
+    cmd->last_line_len = len;
+
+    uint64_t start = now_ns();
+    struct socket_block *socket_block = get_socket_block(bar, cmd->id);
+    size_t count = 0;
+    struct text_block *block = NULL;
+    if (line[0] == '[')
+        block = parse_input(line, len, &socket_block->arena, &bar->colors, NULL, NULL, &count);
+    if (count == 0)
+        block = parse_raw_input(line, len, bar->text_color, &socket_block->arena, &count);
+    socket_block->block = *block;
+    socket_block->text_only = line[0] != '[';
+    socket_block_changed(bar, socket_block);
+    stats_stage(&bar->stats, STAGE_PARSE, start);
 }
 
-static void draw(struct limebar *bar) {
-    printf("Drawing started\n");
+/* The child exited: reap it and schedule the next run, backing off after
+ * failures. A persistent command that ran for a minute counts as healthy. */
+static void command_exited(struct limebar *bar, int index) {
+    struct command_block *cmd = &bar->commands[index];
+    int status = 0;
+    waitpid(cmd->pid, &status, 0);
+    if (cmd->pidfd >= 0)
+        close(cmd->pidfd);
+    cmd->pidfd = -1;
+    cmd->pid = 0;
 
-    // Clear with background color and opacity
-    cairo_set_source_rgba(bar->cairo,
-        bar->bg_color.r,
-        bar->bg_color.g,
-        bar->bg_color.b,
-        bar->bg_color.a * bar->config->opacity);
-    cairo_paint(bar->cairo);
+    bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    if (cmd->interval == 0)
+        failed = now_ns() - cmd->started_ns < 60 * 1000000000ull;
 
-    if (!bar->pango_context) {
-        bar->pango_context = pango_cairo_create_context(bar->cairo);
-        bar->pango_layout = pango_layout_new(bar->pango_context);
+    if (!failed) {
+        cmd->failures = 0;
+        if (cmd->interval == 0)
+            command_arm(cmd, 1000, false);
+        else if (!cmd->periodic)
+            command_arm(cmd, (uint64_t)cmd->interval * 1000, true);
+        return;
     }
 
-    // First pass: calculate total width and widths for each block
-    int total_width = 0;
-    int num_blocks = 0;
-    struct {
-        int width;
-        int height;
-        struct text_block *block;
-    } *block_dims;
-
-    // Count blocks and allocate array
-    for (struct text_block *block = bar->blocks; block; block = block->next) num_blocks++;
-    block_dims = calloc(num_blocks, sizeof(*block_dims));
-
-    // Calculate dimensions
-    int idx = 0;
-    for (struct text_block *block = bar->blocks; block; block = block->next) {
-        PangoFontDescription *font_desc = pango_font_description_from_string(
-            bar->fonts[block->font_index]);
-        pango_layout_set_font_description(bar->pango_layout, font_desc);
-        pango_layout_set_text(bar->pango_layout, block->text, -1);
-
-        pango_layout_get_pixel_size(bar->pango_layout,
-            &block_dims[idx].width,
-            &block_dims[idx].height);
-        block_dims[idx].block = block;
-
-        total_width += block_dims[idx].width;
-        if (idx > 0 && bar->config->separator) {
-            total_width += strlen(bar->config->separator) * 8; // Approximate separator width
-        }
-        total_width += bar->config->padding * 2;
-
-        pango_font_description_free(font_desc);
-        idx++;
-    }
-
-    // Calculate starting x position based on alignment
-    int start_x = bar->config->margin_left;
-    int available_width = bar->width - bar->config->margin_left - bar->config->margin_right;
-
-    if (bar->config->default_alignment == ALIGN_DEFAULT_CENTER) {
-        start_x = (available_width - total_width) / 2 + bar->config->margin_left;
-    } else if (bar->config->default_alignment == ALIGN_DEFAULT_RIGHT) {
-        start_x = available_width - total_width + bar->config->margin_left;
-    }
-
-    // Second pass: actual drawing
-    int x = start_x;
-    for (int i = 0; i < num_blocks; i++) {
-        struct text_block *block = block_dims[i].block;
-        int width = block_dims[i].width;
-        int height = block_dims[i].height;
-
-        // Draw background if specified
-        if (block->bg_color) {
-            double r, g, b;
-            parse_color(block->bg_color, &r, &g, &b);
-            cairo_set_source_rgb(bar->cairo, r, g, b);
-            cairo_rectangle(bar->cairo,
-                x - bar->config->padding,
-                bar->config->margin_top,
-                width + bar->config->padding * 2,
-                bar->height - bar->config->margin_top - bar->config->margin_bottom);
-            cairo_fill(bar->cairo);
-        }
-
-        // Set font and draw text
-        PangoFontDescription *font_desc = pango_font_description_from_string(
-            bar->fonts[block->font_index]);
-        pango_layout_set_font_description(bar->pango_layout, font_desc);
-        pango_layout_set_text(bar->pango_layout, block->text, -1);
-
-        // Set text color
-        if (block->fg_color) {
-            double r, g, b;
-            parse_color(block->fg_color, &r, &g, &b);
-            cairo_set_source_rgb(bar->cairo, r, g, b);
-        } else {
-            cairo_set_source_rgb(bar->cairo, 1.0, 1.0, 1.0);
-        }
+    cmd->failures++;
+    uint64_t delay = cmd->interval ? cmd->interval : 1;
+    delay <<= cmd->failures < 8 ? cmd->failures : 8;
+    if (delay > COMMAND_BACKOFF_MAX)
+        delay = COMMAND_BACKOFF_MAX;
+    fprintf(stderr, "Block %s failed, retrying in %llus\n", cmd->id, (unsigned long long)delay);
+    command_arm(cmd, delay * 1000, false);
+}
 
-        // Draw text
-        int y = (bar->height - height) / 2;
-        if (bar->config->position == POSITION_TOP) {
-            y += bar->config->margin_top;
-        } else {
-            y += bar->config->margin_bottom;
-        }
+static void command_timer(struct limebar *bar, int index) {
+    struct command_block *cmd = &bar->commands[index];
+    uint64_t expirations;
+    if (read(cmd->timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
 
-        cairo_move_to(bar->cairo, x, y);
-        pango_cairo_show_layout(bar->cairo, bar->pango_layout);
+    // Never overlap runs of the same command
+    if (cmd->pid)
+        return;
+    if (cmd->out_fd >= 0) {
+        close(cmd->out_fd);
+        cmd->out_fd = -1;
+    }
+    command_spawn(bar, index);
+}
 
-        // Draw underline
-        if (block->underline) {
-            double r, g, b;
-            if (block->underline_color) {
-                parse_color(block->underline_color, &r, &g, &b);
-            } else if (block->fg_color) {
-                parse_color(block->fg_color, &r, &g, &b);
-            } else {
-                r = g = b = 1.0;
-            }
+static void command_event(struct limebar *bar, uint32_t tag) {
+    int index = (tag - EVENT_COMMAND) / 3;
+    switch ((tag - EVENT_COMMAND) % 3) {
+        case 0:
+            command_output(bar, index);
+            break;
+        case 1:
+            command_exited(bar, index);
+            break;
+        case 2:
+            command_timer(bar, index);
+            break;
+    }
+}
+
+static void commands_start(struct limebar *bar) {
+    int num_periodic = 0;
+    for (int i = 0; i < bar->num_commands; i++) {
+        if (bar->commands[i].interval)
+            num_periodic++;
+    }
 
-            cairo_set_source_rgb(bar->cairo, r, g, b);
-            cairo_set_line_width(bar->cairo, bar->config->underline_thickness);
-            cairo_move_to(bar->cairo, x,
-                bar->height - bar->config->margin_bottom - bar->config->underline_thickness);
-            cairo_line_to(bar->cairo, x + width,
-                bar->height - bar->config->margin_bottom - bar->config->underline_thickness);
-            cairo_stroke(bar->cairo);
+    int n = 0;
+    for (int i = 0; i < bar->num_commands; i++) {
+        struct command_block *cmd = &bar->commands[i];
+        cmd->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (cmd->timer_fd < 0) {
+            fprintf(stderr, "Failed to create timer for block %s: %s\n", cmd->id, strerror(errno));
+            continue;
         }
+        watch_fd(bar, cmd->timer_fd, command_tag(i, 2));
 
-        x += width + bar->config->padding * 2;
+        // Spread the periodic commands evenly over one second
+        if (cmd->interval)
+            command_arm(cmd, (uint64_t)n++ * 1000 / num_periodic, true);
+        else
+            command_spawn(bar, i);
+    }
+}
 
-        // Draw separator if not last block
-        if (i < num_blocks - 1 && bar->config->separator) {
-            cairo_set_source_rgb(bar->cairo, 1.0, 1.0, 1.0);  // Separator color
-            PangoFontDescription *sep_font = pango_font_description_from_string(bar->fonts[0]);
-            pango_layout_set_font_description(bar->pango_layout, sep_font);
-            pango_layout_set_text(bar->pango_layout, bar->config->separator, -1);
-            cairo_move_to(bar->cairo, x - bar->config->padding, y);
-            pango_cairo_show_layout(bar->cairo, bar->pango_layout);
-            pango_font_description_free(sep_font);
+static void commands_finish(struct limebar *bar) {
+    for (int i = 0; i < bar->num_commands; i++) {
+        struct command_block *cmd = &bar->commands[i];
+        if (cmd->pid) {
+            kill(cmd->pid, SIGTERM);
+            waitpid(cmd->pid, NULL, 0);
         }
-
-        pango_font_description_free(font_desc);
+        if (cmd->pidfd >= 0)
+            close(cmd->pidfd);
+        if (cmd->out_fd >= 0)
+            close(cmd->out_fd);
+        if (cmd->timer_fd >= 0)
+            close(cmd->timer_fd);
+        free(cmd->output.data);
+        free(cmd->last_line);
+        free(cmd->id);
+        free(cmd->command);
     }
+    free(bar->commands);
+}
 
-    free(block_dims);
+/* Stdin hit EOF or failed. Stop watching it so a dead producer costs no
+ * wakeups, and either keep showing the last frame or quit. */
+static void stdin_closed(struct limebar *bar) {
+    epoll_ctl(bar->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    TRACE(TRACE_FRAME, "stdin closed\n");
+    if (bar->config->exit_on_eof)
+        bar->running = false;
+}
 
-    // Commit the surface
-    wl_surface_attach(bar->surface, bar->buffer, 0, 0);
-    wl_surface_damage_buffer(bar->surface, 0, 0, bar->width, bar->height);
-    wl_surface_commit(bar->surface);
+/* Drop everything shaped or rendered with the old fonts. The default font
+ * map is replaced so fontconfig changes are picked up, then the whole bar is
+ * repainted. */
+static void reload(struct limebar *bar) {
+    if (bar->render.running)
+        atomic_store(&bar->render.reload, true);
+    else
+        reset_render_state(bar);
+    mark_dirty(bar);
+    render_frame(bar);
+}
 
-    printf("Drawing completed\n");
+/* SIGINT and SIGTERM end the main loop so cleanup runs; SIGHUP reloads. */
+static void handle_signal(struct limebar *bar) {
+    struct signalfd_siginfo info;
+    while (read(bar->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGHUP)
+            reload(bar);
+        else
+            bar->running = false;
+    }
 }
 
-static void registry_global(void *data, struct wl_registry *registry,
-        uint32_t name, const char *interface, uint32_t version) {
-    struct limebar *bar = data;
-    (void)version;
+/* Keep timer_fd armed for the earliest of a frame held back by --max-fps
+ * and the next --stats dump. */
+static void arm_timer(struct limebar *bar) {
+    uint64_t deadline = 0;
 
-    if (strcmp(interface, wl_compositor_interface.name) == 0) {
-        bar->compositor = wl_registry_bind(registry, name,
-                &wl_compositor_interface, 4);
-    } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
-        bar->layer_shell = wl_registry_bind(registry, name,
-                &zwlr_layer_shell_v1_interface, 1);
-    } else if (strcmp(interface, wl_shm_interface.name) == 0) {
-        bar->shm = wl_registry_bind(registry, name,
-                &wl_shm_interface, 1);
+    // A frame waiting on a buffer release is woken by the compositor
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        struct bar_output *output = bar->outputs[i];
+        if (!output->dirty || output->frame_callback || frame_delay_ms(bar, output) == 0)
+            continue;
+        uint64_t held = output->last_frame_ns + bar->min_frame_ns;
+        if (!deadline || held < deadline)
+            deadline = held;
     }
+    if (bar->config->stats_interval && (!deadline || bar->next_stats_ns < deadline))
+        deadline = bar->next_stats_ns;
+
+    if (deadline == bar->timer_deadline)
+        return;
+    bar->timer_deadline = deadline;
+
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = deadline / 1000000000ull,
+            .tv_nsec = deadline % 1000000000ull,
+        },
+    };
+    timerfd_settime(bar->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
 }
 
-static void registry_global_remove(void *data,
-        struct wl_registry *registry, uint32_t name) {
-    (void)data;
-    (void)registry;
-    (void)name;
+/* Send queued requests; when the socket is full, wait for it to drain
+ * before flushing the rest. */
+static void flush_display(struct limebar *bar) {
+    struct pollfd pfd = {.fd = wl_display_get_fd(bar->display), .events = POLLOUT};
+
+    while (wl_display_flush(bar->display) < 0 && errno == EAGAIN) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+    }
 }
 
-static void layer_surface_configure(void *data,
-        struct zwlr_layer_surface_v1 *surface,
-        uint32_t serial, uint32_t width, uint32_t height) {
-    struct limebar *bar = data;
+static bool setup_event_loop(struct limebar *bar) {
+    bar->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bar->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (bar->epoll_fd < 0 || bar->timer_fd < 0) {
+        fprintf(stderr, "Failed to set up event loop: %s\n", strerror(errno));
+        return false;
+    }
 
-    // Only update dimensions if they changed
-    if (width > 0) bar->width = width;
-    if (height > 0) bar->height = height;
+    // Handle termination in the loop so the cleanup code runs
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    bar->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (bar->signal_fd < 0) {
+        fprintf(stderr, "Failed to create signalfd: %s\n", strerror(errno));
+        return false;
+    }
 
-    zwlr_layer_surface_v1_ack_configure(surface, serial);
+    watch_fd(bar, wl_display_get_fd(bar->display), EVENT_DISPLAY);
+    watch_fd(bar, bar->timer_fd, EVENT_TIMER);
+    watch_fd(bar, bar->signal_fd, EVENT_SIGNAL);
+    if (bar->control_fd >= 0)
+        watch_fd(bar, bar->control_fd, EVENT_CONTROL);
+    if (bar->render.running)
+        watch_fd(bar, bar->render.done_fd, EVENT_RENDER);
+    commands_start(bar);
 
-    // Clean up existing buffer if it exists
-    if (bar->buffer) {
-        wl_buffer_destroy(bar->buffer);
-        cairo_destroy(bar->cairo);
-        cairo_surface_destroy(bar->cairo_surface);
-        munmap(bar->shm_data, bar->width * bar->height * 4);
-        bar->buffer = NULL;
-        bar->cairo = NULL;
-        bar->cairo_surface = NULL;
-        bar->shm_data = NULL;
+    // Regular files can't be polled; they are read in one go instead
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = EVENT_STDIN};
+    if (epoll_ctl(bar->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0) {
+        if (errno != EPERM) {
+            fprintf(stderr, "Failed to watch stdin: %s\n", strerror(errno));
+            return false;
+        }
+        while (read_stdin(bar))
+            ;
+        bar->running = !bar->config->exit_on_eof;
+        return true;
     }
 
-    create_buffer(bar);
-    draw(bar);
+    bar->running = true;
+    return true;
 }
 
-static void layer_surface_closed(void *data,
-        struct zwlr_layer_surface_v1 *surface) {
-    (void)data;
-    (void)surface;
-}
+static int run_wayland(struct limebar *bar) {
+    // Connect to Wayland display
+    bar->display = wl_display_connect(NULL);
+    if (!bar->display) {
+        fprintf(stderr, "Failed to connect to Wayland display\n");
+        return 1;
+    }
 
-static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
-    .configure = layer_surface_configure,
-    .closed = layer_surface_closed,
-};
+    // Get registry
+    bar->registry = wl_display_get_registry(bar->display);
+    wl_registry_add_listener(bar->registry, &registry_listener, bar);
+    wl_display_roundtrip(bar->display);
+
+    if (!bar->compositor || !bar->layer_shell || !bar->shm) {
+        fprintf(stderr, "Missing required Wayland interfaces\n");
+        return 1;
+    }
+    if (bar->config->render_thread && !render_thread_start(bar))
+        return 1;
+
+    // Put a bar on every output and wait for their configure events. With
+    // no output advertised yet, let the compositor pick one until one is.
+    if (bar->num_outputs == 0)
+        output_add(bar, 0, NULL);
+    for (size_t i = 0; i < bar->num_outputs; i++) {
+        if (!output_create_surface(bar->outputs[i]))
+            return 1;
+    }
+    bar->outputs_live = true;
+    wl_display_roundtrip(bar->display);
+
+    if (!setup_event_loop(bar))
+        return 1;
+
+    int ret = 0;
+    while (bar->running) {
+        // Queue up everything already read before blocking, then send
+        // our requests; the read is only performed if the display fd
+        // turns out readable.
+        while (wl_display_prepare_read(bar->display) != 0)
+            wl_display_dispatch_pending(bar->display);
+        flush_display(bar);
+        arm_timer(bar);
 
-static void read_stdin(struct limebar *bar) {
-    char buffer[1024];
-    ssize_t bytes_read = read(STDIN_FILENO, buffer, sizeof(buffer) - 1);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-
-        // Remove trailing newline if present
-        if (buffer[bytes_read - 1] == '\n') {
-            buffer[bytes_read - 1] = '\0';
-        }
-
-        // Free old blocks
-        struct text_block *block = bar->blocks;
-        while (block) {
-            struct text_block *next = block->next;
-            free(block->text);
-            free(block->fg_color);
-            free(block->bg_color);
-            free(block->underline_color);
-            free(block);
-            block = next;
-        }
-        bar->blocks = NULL;
-
-        if (bar->config->raw_mode) {
-            // Create a single block with the raw text
-            struct text_block *block = calloc(1, sizeof(struct text_block));
-            block->text = strdup(buffer);
-            block->fg_color = bar->config->text_color ? strdup(bar->config->text_color) : NULL;
-            block->font_index = 0;
-            bar->blocks = block;
+        struct epoll_event events[16];
+        int count = epoll_wait(bar->epoll_fd, events, 16, -1);
+        if (count < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            wl_display_cancel_read(bar->display);
+            ret = 1;
+            break;
+        }
+
+        uint32_t display_events = 0;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u32 == EVENT_DISPLAY)
+                display_events = events[i].events;
+        }
+        if (display_events & EPOLLIN) {
+            if (wl_display_read_events(bar->display) < 0) {
+                fprintf(stderr, "Lost connection to Wayland display\n");
+                ret = 1;
+                break;
+            }
         } else {
-            // Parse input as blocks
-            bar->blocks = parse_input(buffer);
+            wl_display_cancel_read(bar->display);
+        }
+        if (display_events & (EPOLLERR | EPOLLHUP) && !(display_events & EPOLLIN)) {
+            fprintf(stderr, "Lost connection to Wayland display\n");
+            ret = 1;
+            break;
+        }
+        if (wl_display_dispatch_pending(bar->display) < 0) {
+            fprintf(stderr, "Wayland protocol error\n");
+            ret = 1;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint32_t tag = events[i].data.u32;
+            switch (tag) {
+                case EVENT_DISPLAY:
+                    break;
+                case EVENT_STDIN:
+                    // Drain what is left before acting on a hangup
+                    if (!read_stdin(bar))
+                        stdin_closed(bar);
+                    break;
+                case EVENT_TIMER: {
+                    uint64_t expirations;
+                    if (read(bar->timer_fd, &expirations, sizeof(expirations)) > 0)
+                        bar->timer_deadline = 0;
+                    render_frame(bar);
+                    maybe_dump_stats(bar);
+                    break;
+                }
+                case EVENT_SIGNAL:
+                    handle_signal(bar);
+                    break;
+                case EVENT_CONTROL:
+                    control_accept(bar);
+                    break;
+                case EVENT_RENDER:
+                    render_thread_collect(bar);
+                    break;
+                default:
+                    if (tag >= EVENT_MODULE && tag < EVENT_MODULE + NUM_MODULES)
+                        module_tick(bar, tag - EVENT_MODULE);
+                    else if (tag >= EVENT_CLIENT && tag < EVENT_CLIENT + MAX_CONTROL_CLIENTS &&
+                            bar->clients[tag - EVENT_CLIENT].fd >= 0)
+                        control_read(bar, &bar->clients[tag - EVENT_CLIENT]);
+                    else if (tag >= EVENT_COMMAND)
+                        command_event(bar, tag);
+                    break;
+            }
         }
 
-        // Redraw
-        draw(bar);
+        // Block command output only marks the bar dirty, so everything
+        // that landed in this batch goes out in one frame
+        render_frame(bar);
     }
+
+    wl_display_flush(bar->display);
+    return ret;
 }
 
 int main(int argc, char *argv[]) {
@@ -546,7 +5420,31 @@ int main(int argc, char *argv[]) {
         .opacity = 1.0,
         .raw_mode = false,
         .text_color = "#ffffff",  // Default to white text
+        .max_fps = 0,
+        .block_cache_kib = DEFAULT_BLOCK_CACHE_KIB,
+    };
+
+    enum {
+        OPT_MAX_FPS = 256,
+        OPT_BLOCK_CACHE,
+        OPT_BENCH_PARSE,
+        OPT_BENCH_FILL,
+        OPT_HEADLESS,
+        OPT_DUMP,
+        OPT_BENCH,
+        OPT_BENCH_FRAMES,
+        OPT_STATS,
+        OPT_CONTROL,
+        OPT_ON_EOF,
+        OPT_BLOCK,
+        OPT_JSON,
+        OPT_RGB565,
+        OPT_RENDER_THREAD,
     };
+    long bench_iterations = 0;
+    long bench_fill_iterations = 0;
+    const char *bench_scenario = NULL;
+    long bench_frames = 1000;
 
     static struct option long_options[] = {
         {"geometry", required_argument, 0, 'g'},
@@ -562,6 +5460,21 @@ int main(int argc, char *argv[]) {
         {"help", no_argument, 0, 'h'},
         {"raw", no_argument, 0, 'r'},
                 {"text-color", required_argument, 0, 'F'},
+        {"max-fps", required_argument, 0, OPT_MAX_FPS},
+        {"block-cache", required_argument, 0, OPT_BLOCK_CACHE},
+        {"bench-parse", required_argument, 0, OPT_BENCH_PARSE},
+        {"bench-fill", required_argument, 0, OPT_BENCH_FILL},
+        {"headless", no_argument, 0, OPT_HEADLESS},
+        {"dump", required_argument, 0, OPT_DUMP},
+        {"bench", required_argument, 0, OPT_BENCH},
+        {"bench-frames", required_argument, 0, OPT_BENCH_FRAMES},
+        {"stats", required_argument, 0, OPT_STATS},
+        {"control", required_argument, 0, OPT_CONTROL},
+        {"on-eof", required_argument, 0, OPT_ON_EOF},
+        {"block", required_argument, 0, OPT_BLOCK},
+        {"json", no_argument, 0, OPT_JSON},
+        {"rgb565", no_argument, 0, OPT_RGB565},
+        {"render-thread", no_argument, 0, OPT_RENDER_THREAD},
                 {0, 0, 0, 0}
     };
 
@@ -621,6 +5534,65 @@ int main(int argc, char *argv[]) {
                 if (config.opacity < 0.0) config.opacity = 0.0;
                 if (config.opacity > 1.0) config.opacity = 1.0;
                 break;
+            case OPT_MAX_FPS:
+                config.max_fps = atoi(optarg);
+                if (config.max_fps < 0) config.max_fps = 0;
+                break;
+            case OPT_BLOCK_CACHE:
+                config.block_cache_kib = atoi(optarg);
+                if (config.block_cache_kib < 0) config.block_cache_kib = 0;
+                break;
+            case OPT_BENCH_PARSE:
+                bench_iterations = atol(optarg);
+                break;
+            case OPT_BENCH_FILL:
+                bench_fill_iterations = atol(optarg);
+                break;
+            case OPT_HEADLESS:
+                config.headless = true;
+                break;
+            case OPT_DUMP:
+                config.dump_path = optarg;
+                break;
+            case OPT_BENCH:
+                bench_scenario = optarg;
+                break;
+            case OPT_BENCH_FRAMES:
+                bench_frames = atol(optarg);
+                if (bench_frames < 1) bench_frames = 1;
+                break;
+            case OPT_STATS:
+                config.stats_interval = atoi(optarg);
+                if (config.stats_interval < 0) config.stats_interval = 0;
+                break;
+            case OPT_CONTROL:
+                config.control_path = optarg;
+                break;
+            case OPT_ON_EOF:
+                if (strcmp(optarg, "exit") == 0) {
+                    config.exit_on_eof = true;
+                } else if (strcmp(optarg, "keep") == 0) {
+                    config.exit_on_eof = false;
+                } else {
+                    fprintf(stderr, "Invalid --on-eof policy: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_RGB565:
+                config.rgb565 = true;
+                break;
+            case OPT_RENDER_THREAD:
+                config.render_thread = true;
+                break;
+            case OPT_JSON:
+                config.json = true;
+                break;
+            case OPT_BLOCK:
+                config.num_commands++;
+                config.commands = realloc(config.commands, sizeof(char*) * config.num_commands);
+                config.commands[config.num_commands - 1] = optarg;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -630,6 +5602,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    fill_init();
+    if (bench_iterations > 0) {
+        bench_parse(bench_iterations);
+        return 0;
+    }
+    if (bench_fill_iterations > 0) {
+        bench_fill(bench_fill_iterations);
+        return 0;
+    }
+
     // Set default fonts if none specified
     if (config.num_fonts == 0) {
         config.num_fonts = 2;
@@ -643,123 +5625,123 @@ int main(int argc, char *argv[]) {
     bar.height = config.height;
     bar.num_fonts = config.num_fonts;
     bar.fonts = config.fonts;
+    bar.font_descs = malloc(sizeof(PangoFontDescription *) * bar.num_fonts);
+    for (int i = 0; i < bar.num_fonts; i++)
+        bar.font_descs[i] = pango_font_description_from_string(bar.fonts[i]);
     bar.config = &config;  // Set the config pointer
-
-    // Set background color
-    parse_color_str(config.background_color,
-        &bar.bg_color.r,
-        &bar.bg_color.g,
-        &bar.bg_color.b,
-        &bar.bg_color.a);
-
-    // Connect to Wayland display
-    bar.display = wl_display_connect(NULL);
-    if (!bar.display) {
-        fprintf(stderr, "Failed to connect to Wayland display\n");
-        return 1;
+    if (config.max_fps > 0)
+        bar.min_frame_ns = 1000000000ull / config.max_fps;
+    bar.scale = SCALE_ONE;
+    bar.block_cache.budget = (size_t)config.block_cache_kib * 1024;
+    bar.next_stats_ns = now_ns() + (uint64_t)config.stats_interval * 1000000000ull;
+    bar.control_fd = -1;
+    bar.render.wake_fd = -1;
+    bar.render.done_fd = -1;
+    modules_init(bar.modules);
+    bar.commands = calloc(config.num_commands, sizeof(struct command_block));
+    for (int i = 0; i < config.num_commands; i++) {
+        if (!parse_command_spec(config.commands[i], &bar.commands[bar.num_commands])) {
+            fprintf(stderr, "Invalid block command: %s\n", config.commands[i]);
+            return 1;
+        }
+        bar.num_commands++;
     }
-
-    // Get registry
-    bar.registry = wl_display_get_registry(bar.display);
-    wl_registry_add_listener(bar.registry, &registry_listener, &bar);
-    wl_display_roundtrip(bar.display);
-
-    if (!bar.compositor || !bar.layer_shell || !bar.shm) {
-        fprintf(stderr, "Missing required Wayland interfaces\n");
+    free(config.commands);
+    bar.epoll_fd = -1;
+    bar.timer_fd = -1;
+    bar.signal_fd = -1;
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++)
+        bar.clients[i].fd = -1;
+    if (config.control_path && !control_open(&bar, config.control_path))
         return 1;
-    }
 
-    // Create surface
-    bar.surface = wl_compositor_create_surface(bar.compositor);
-    if (!bar.surface) {
-        fprintf(stderr, "Failed to create surface\n");
-        return 1;
+    // Resolve the bar colors once; opacity scales the background alpha
+    uint32_t background = 0;
+    if (parse_color(config.background_color, strlen(config.background_color), &background)) {
+        uint8_t a = (background >> 24) * config.opacity + 0.5;
+        uint8_t r = (background >> 16) & 0xff, g = (background >> 8) & 0xff, b = background & 0xff;
+        // Scale the already premultiplied channels along with alpha
+        bar.background = (uint32_t)a << 24 |
+            (uint32_t)(r * config.opacity + 0.5) << 16 |
+            (uint32_t)(g * config.opacity + 0.5) << 8 |
+            (uint32_t)(b * config.opacity + 0.5);
     }
+    bar.text_color = COLOR_WHITE;
+    if (config.text_color)
+        bar.text_color = resolve_color(&bar.colors, config.text_color);
 
-    // Create layer surface
-    bar.layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-                bar.layer_shell, bar.surface, NULL,
-                ZWLR_LAYER_SHELL_V1_LAYER_TOP, "limebar");
-        if (!bar.layer_surface) {
-            fprintf(stderr, "Failed to create layer surface\n");
-            return 1;
-        }
-
-        // Set exclusive zone to reserve space
-        zwlr_layer_surface_v1_set_exclusive_zone(bar.layer_surface, bar.height);
-
-        // Set size
-        zwlr_layer_surface_v1_set_size(bar.layer_surface, bar.width, bar.height);
-
-        // Set anchor based on position
-        uint32_t anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
-        if (bar.config->position == POSITION_BOTTOM) {
-            anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
-        } else {
-            anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP;
-        }
-        zwlr_layer_surface_v1_set_anchor(bar.layer_surface, anchor);
-    zwlr_layer_surface_v1_add_listener(bar.layer_surface,
-            &layer_surface_listener, &bar);
-
-    // Commit the surface and wait for the configure event
-    wl_surface_commit(bar.surface);
-    wl_display_roundtrip(bar.display);
-
-    // Set up polling
-    struct pollfd fds[2] = {
-        {.fd = STDIN_FILENO, .events = POLLIN},
-        {.fd = wl_display_get_fd(bar.display), .events = POLLIN}
-    };
-
-    // Main event loop with polling
-    while (1) {
-        wl_display_flush(bar.display);
-        if (poll(fds, 2, -1) > 0) {
-            if (fds[0].revents & POLLIN) {
-                read_stdin(&bar);
-            }
-            if (fds[1].revents & POLLIN) {
-                if (wl_display_dispatch(bar.display) < 0) {
-                    break;
-                }
-            }
-        }
+    int ret;
+    if (bench_scenario) {
+        ret = run_bench(&bar, bench_scenario, bench_frames);
+    } else if (config.headless) {
+        bar.min_frame_ns = 0;
+        ret = run_headless(&bar);
+    } else {
+        ret = run_wayland(&bar);
     }
 
     // Cleanup
-    if (config.separator) free(config.separator);
-    struct text_block *block = bar.blocks;
-    while (block) {
-        struct text_block *next = block->next;
-        free(block->text);
-        free(block->fg_color);
-        free(block->bg_color);
-        free(block->underline_color);
-        free(block);
-        block = next;
+    render_thread_stop(&bar);
+    commands_finish(&bar);
+    control_close(&bar);
+    modules_finish(&bar);
+    if (bar.epoll_fd >= 0)
+        close(bar.epoll_fd);
+    if (bar.timer_fd >= 0)
+        close(bar.timer_fd);
+    if (bar.signal_fd >= 0)
+        close(bar.signal_fd);
+    free(bar.input.data);
+    for (size_t i = 0; i < bar.num_json_blocks; i++) {
+        free(bar.json_blocks[i].arena.data);
+        free(bar.json_blocks[i].id);
     }
+    free(bar.json_blocks);
+    free(bar.json_line);
+    if (config.separator) free(config.separator);
+    free(bar.block_arena.data);
+    free(bar.frame);
+    free(bar.block_segments);
+    free(bar.repaint.spans);
+    free(bar.surface_damage.spans);
+    if (config.stats_interval)
+        dump_stats(&bar);
+    block_cache_finish(&bar.block_cache);
+    layout_cache_finish(&bar.layouts);
+    for (size_t i = 0; i < bar.num_strips; i++)
+        marquee_strip_free(bar.strips[i]);
+    free(bar.strips);
+    for (size_t i = 0; i < bar.num_atlases; i++)
+        glyph_atlas_free(bar.atlases[i]);
+    free(bar.atlases);
     for (int i = 0; i < config.num_fonts; i++) {
+        pango_font_description_free(bar.font_descs[i]);
         free(config.fonts[i]);
     }
+    free(bar.font_descs);
+    for (size_t i = 0; i < bar.num_scaled_fonts; i++) {
+        for (int j = 0; j < config.num_fonts; j++)
+            pango_font_description_free(bar.scaled_fonts[i].descs[j]);
+        free(bar.scaled_fonts[i].descs);
+    }
+    free(bar.scaled_fonts);
     free(config.fonts);
+    if (bar.pango_context)
+        g_object_unref(bar.pango_context);
 
-    if (bar.cairo)
-        cairo_destroy(bar.cairo);
-    if (bar.cairo_surface)
-        cairo_surface_destroy(bar.cairo_surface);
-    if (bar.buffer)
-        wl_buffer_destroy(bar.buffer);
-    if (bar.shm_data)
-        munmap(bar.shm_data, bar.width * bar.height * 4);
-    if (bar.layer_surface)
-        zwlr_layer_surface_v1_destroy(bar.layer_surface);
-    if (bar.surface)
-        wl_surface_destroy(bar.surface);
+    for (size_t i = 0; i < bar.num_outputs; i++)
+        output_free(bar.outputs[i]);
+    free(bar.outputs);
+    if (bar.fractional_scale_manager)
+        wp_fractional_scale_manager_v1_destroy(bar.fractional_scale_manager);
+    if (bar.viewporter)
+        wp_viewporter_destroy(bar.viewporter);
     if (bar.layer_shell)
         zwlr_layer_shell_v1_destroy(bar.layer_shell);
     if (bar.shm)
         wl_shm_destroy(bar.shm);
+    if (bar.subcompositor)
+        wl_subcompositor_destroy(bar.subcompositor);
     if (bar.compositor)
         wl_compositor_destroy(bar.compositor);
     if (bar.registry)
@@ -767,5 +5749,5 @@ int main(int argc, char *argv[]) {
     if (bar.display)
         wl_display_disconnect(bar.display);
 
-    return 0;
+    return ret;
 }